@@ -0,0 +1,400 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <new>
+#include <opencv2/opencv.hpp>
+#include <random>
+#include <sstream>
+#include <thread>
+
+#if _WIN32
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+#define STRIP_FLAG_HELP 1
+#include <gflags/gflags.h>
+
+#include "sam.h"
+#include "sam_embedding_store.h"
+
+DEFINE_string(pre_model, "models/sam_preprocess.onnx", "Path to the real preprocessing model");
+DEFINE_string(sam_model, "models/sam_vit_h_4b8939.onnx", "Path to the real sam model");
+DEFINE_string(synthetic_dir, "models/bench",
+              "Directory of the stand-in models generated by export_bench_models.py");
+DEFINE_string(sets, "real,sam,hq,edge", "Model sets to run (real is skipped if not found)");
+DEFINE_string(image, "images/input.jpg", "Image to encode (random pixels if not found)");
+DEFINE_string(output, "", "Write the JSON results to this file instead of stdout");
+DEFINE_int32(threads, 0, "Number of threads per session (0 for all cores)");
+DEFINE_int32(encoder_runs, 5, "Number of timed encoder runs");
+DEFINE_int32(decoder_runs, 100, "Number of timed decoder runs");
+DEFINE_int32(auto_points, 16, "Number of autoSegment grid points on each side");
+DEFINE_int32(points_per_batch, 64, "Grid points per decoder run in autoSegment");
+DEFINE_int32(instances, 4, "Number of instances decoding concurrently (1 to skip)");
+DEFINE_bool(global_thread_pool, false, "Share global thread pools between all sessions");
+DEFINE_int32(max_batch_size, 16, "Maximum number of concurrent getMask prompts per decoder run");
+DEFINE_int32(batch_window_us, 0, "Time a getMask prompt waits for others before its run");
+DEFINE_int32(tracks, 8, "Number of objects tracked across frames (0 to skip)");
+DEFINE_bool(h, false, "Show help");
+
+// Count the allocations made through operator new (ONNX Runtime and the standard library, not
+// OpenCV which uses its own allocator)
+static std::atomic<size_t> g_allocations{0};
+
+void* operator new(size_t size) {
+  g_allocations++;
+  if (void* p = std::malloc(size > 0 ? size : 1)) {
+    return p;
+  }
+  throw std::bad_alloc();
+}
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete(void* p, size_t) noexcept { std::free(p); }
+
+static size_t peakRss() {
+#if _WIN32
+  PROCESS_MEMORY_COUNTERS counters;
+  GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters));
+  return counters.PeakWorkingSetSize;
+#else
+  rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return size_t(usage.ru_maxrss) * 1024;
+#endif
+}
+
+struct Latency {
+  std::vector<double> ms;
+
+  double percentile(double p) const {
+    if (ms.empty()) {
+      return 0;
+    }
+    auto sorted = ms;
+    std::sort(sorted.begin(), sorted.end());
+    return sorted[std::min(sorted.size() - 1, size_t(p / 100 * sorted.size()))];
+  }
+  double mean() const {
+    double sum = 0;
+    for (auto v : ms) {
+      sum += v;
+    }
+    return ms.empty() ? 0 : sum / ms.size();
+  }
+  std::string json() const {
+    std::ostringstream s;
+    s << "{\"runs\": " << ms.size() << ", \"mean_ms\": " << mean()
+      << ", \"p50_ms\": " << percentile(50) << ", \"p95_ms\": " << percentile(95)
+      << ", \"p99_ms\": " << percentile(99) << "}";
+    return s.str();
+  }
+};
+
+struct ModelSet {
+  std::string name, preModel, samModel;
+  bool bSynthetic;
+};
+
+using Clock = std::chrono::steady_clock;
+static double elapsedMs(const Clock::time_point& start) {
+  return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+
+static bool fileExists(const std::string& path) { return std::ifstream(path).good(); }
+
+// Run all benchmarks of a model set and return the JSON object of its results
+static std::string runBenchmark(const ModelSet& set) {
+  std::ostringstream json;
+  json << "{\"name\": \"" << set.name
+       << "\", \"synthetic\": " << (set.bSynthetic ? "true" : "false");
+
+  const int threads =
+      FLAGS_threads > 0 ? FLAGS_threads : int(std::thread::hardware_concurrency());
+  Sam::Parameter param(set.preModel, set.samModel, threads);
+  param.globalThreadPool = FLAGS_global_thread_pool;
+  param.maxBatchSize = FLAGS_max_batch_size;
+  param.batchWindowUs = FLAGS_batch_window_us;
+  auto start = Clock::now();
+  Sam sam(param);
+  const auto loadMs = elapsedMs(start);
+  const auto inputSize = sam.getInputSize();
+  if (inputSize.empty()) {
+    std::cerr << "Unable to load " << set.preModel << " and " << set.samModel << std::endl;
+    json << ", \"error\": \"model loading failed\"}";
+    return json.str();
+  }
+  json << ", \"load_ms\": " << loadMs << ", \"input_size\": [" << inputSize.width << ", "
+       << inputSize.height << "]";
+
+  cv::Mat image = cv::imread(FLAGS_image, -1);
+  if (image.empty() || image.channels() != 3) {
+    image = cv::Mat(inputSize, CV_8UC3);
+    cv::randu(image, cv::Scalar::all(0), cv::Scalar::all(255));
+  }
+  cv::resize(image, image, inputSize);
+
+  // Encoder, the first run is a warm-up
+  Latency encoder;
+  size_t allocations = 0;
+  for (int i = 0; i <= FLAGS_encoder_runs; i++) {
+    const size_t allocationsBefore = g_allocations;
+    start = Clock::now();
+    sam.loadImage(image);
+    if (i > 0) {
+      encoder.ms.push_back(elapsedMs(start));
+      allocations += g_allocations - allocationsBefore;
+    }
+  }
+  json << ", \"encoder\": " << encoder.json() << ", \"encoder_allocations_per_call\": "
+       << (FLAGS_encoder_runs > 0 ? allocations / FLAGS_encoder_runs : 0);
+
+  // Decoder with random single point prompts
+  std::mt19937 random(0);
+  std::uniform_int_distribution<int> randomX(1, inputSize.width - 1),
+      randomY(1, inputSize.height - 1);
+  sam.getMask({randomX(random), randomY(random)});
+  Latency decoder;
+  allocations = 0;
+  for (int i = 0; i < FLAGS_decoder_runs; i++) {
+    const cv::Point point(randomX(random), randomY(random));
+    const size_t allocationsBefore = g_allocations;
+    start = Clock::now();
+    sam.getMask(point);
+    decoder.ms.push_back(elapsedMs(start));
+    allocations += g_allocations - allocationsBefore;
+  }
+  json << ", \"decoder\": " << decoder.json() << ", \"decoder_allocations_per_call\": "
+       << (FLAGS_decoder_runs > 0 ? allocations / FLAGS_decoder_runs : 0);
+
+  // Automatic segmentation
+  Sam::AutoSegmentParameter autoParam(cv::Size(FLAGS_auto_points, FLAGS_auto_points));
+  autoParam.pointsPerBatch = FLAGS_points_per_batch;
+  int numObjects = 0, decoderRuns = 0;
+  start = Clock::now();
+  sam.autoSegment(autoParam, nullptr, &numObjects, nullptr, &decoderRuns);
+  const auto autoMs = elapsedMs(start);
+  const int decodedPoints = FLAGS_auto_points * FLAGS_auto_points;
+  json << ", \"auto_segment\": {\"ms\": " << autoMs << ", \"decoder_runs\": " << decoderRuns
+       << ", \"points_per_second\": " << (autoMs > 0 ? decodedPoints * 1000 / autoMs : 0)
+       << ", \"objects\": " << numObjects << "}";
+
+  // Decoder latency with several instances (sharing the model) decoding at the same time, one
+  // thread each
+  if (FLAGS_instances > 1 && FLAGS_decoder_runs > 0) {
+    auto sharedModel = Sam::createSharedModel();
+    std::vector<std::unique_ptr<Sam>> instances;
+    for (int i = 0; i < FLAGS_instances; i++) {
+      instances.emplace_back(new Sam(param, sharedModel));
+      instances.back()->loadImage(image);
+    }
+
+    std::vector<Latency> latencies(FLAGS_instances);
+    std::vector<std::thread> workers;
+    start = Clock::now();
+    for (int i = 0; i < FLAGS_instances; i++) {
+      workers.emplace_back([&, i] {
+        std::mt19937 random(i + 1);
+        for (int j = 0; j < FLAGS_decoder_runs; j++) {
+          const cv::Point point(randomX(random), randomY(random));
+          const auto runStart = Clock::now();
+          instances[i]->getMask(point);
+          latencies[i].ms.push_back(elapsedMs(runStart));
+        }
+      });
+    }
+    for (auto& worker : workers) {
+      worker.join();
+    }
+    const auto wallMs = elapsedMs(start);
+
+    Latency concurrent;
+    for (const auto& latency : latencies) {
+      concurrent.ms.insert(concurrent.ms.end(), latency.ms.begin(), latency.ms.end());
+    }
+    json << ", \"concurrent\": {\"instances\": " << FLAGS_instances << ", \"global_thread_pool\": "
+         << (FLAGS_global_thread_pool ? "true" : "false") << ", \"wall_ms\": " << wallMs
+         << ", \"decodes_per_second\": " << concurrent.ms.size() * 1000 / wallMs
+         << ", \"decoder\": " << concurrent.json() << "}";
+  }
+
+  // The same threads decoding on a single instance, their prompts batched together
+  if (FLAGS_instances > 1 && FLAGS_decoder_runs > 0) {
+    const auto before = sam.getStats();
+    std::vector<Latency> latencies(FLAGS_instances);
+    std::vector<std::thread> workers;
+    start = Clock::now();
+    for (int i = 0; i < FLAGS_instances; i++) {
+      workers.emplace_back([&, i] {
+        std::mt19937 random(i + 1);
+        for (int j = 0; j < FLAGS_decoder_runs; j++) {
+          const cv::Point point(randomX(random), randomY(random));
+          const auto runStart = Clock::now();
+          sam.getMask(point);
+          latencies[i].ms.push_back(elapsedMs(runStart));
+        }
+      });
+    }
+    for (auto& worker : workers) {
+      worker.join();
+    }
+    const auto wallMs = elapsedMs(start);
+    const auto after = sam.getStats();
+
+    Latency batched;
+    for (const auto& latency : latencies) {
+      batched.ms.insert(batched.ms.end(), latency.ms.begin(), latency.ms.end());
+    }
+    json << ", \"batched\": {\"threads\": " << FLAGS_instances
+         << ", \"max_batch_size\": " << FLAGS_max_batch_size
+         << ", \"batch_window_us\": " << FLAGS_batch_window_us << ", \"wall_ms\": " << wallMs
+         << ", \"decodes_per_second\": " << batched.ms.size() * 1000 / wallMs
+         << ", \"decoder\": " << batched.json() << ", \"batch_sizes\": {";
+    bool bFirst = true;
+    for (int i = 0; i < Sam::Stats::kBatchSizeBuckets; i++) {
+      const auto runs = after.batchSizes[i] - before.batchSizes[i];
+      if (runs > 0) {
+        json << (bFirst ? "" : ", ") << "\"" << i + 1 << "\": " << runs;
+        bFirst = false;
+      }
+    }
+    json << "}}";
+  }
+
+  // getMask latency while autoSegment runs in the background on the same instance
+  if (FLAGS_decoder_runs > 0) {
+    std::atomic<bool> bSegmenting{true};
+    std::thread background([&] {
+      sam.autoSegment(autoParam);
+      bSegmenting = false;
+    });
+    Latency interactive;
+    while (bSegmenting && int(interactive.ms.size()) < FLAGS_decoder_runs) {
+      const cv::Point point(randomX(random), randomY(random));
+      const auto runStart = Clock::now();
+      sam.getMask(point);
+      interactive.ms.push_back(elapsedMs(runStart));
+    }
+    background.join();
+    json << ", \"interactive_during_auto_segment\": " << interactive.json();
+  }
+
+  // Tracking of several objects, each frame decoding all of them (the frames reuse the embedding
+  // of the image, so that only the decoder is timed)
+  if (FLAGS_tracks > 0 && FLAGS_decoder_runs > 0) {
+    sam.clearTracks();
+    for (int i = 0; i < FLAGS_tracks; i++) {
+      sam.addTrack({{randomX(random), randomY(random)}}, {}, {});
+    }
+    const int added = sam.getTracks().size();
+    Latency frame;
+    std::vector<Sam::Track> tracks;
+    for (int i = 0; i < FLAGS_decoder_runs && !sam.getTracks().empty(); i++) {
+      start = Clock::now();
+      sam.track(tracks, nullptr, 0);
+      frame.ms.push_back(elapsedMs(start));
+    }
+    json << ", \"tracking\": {\"tracks\": " << added << ", \"frame\": " << frame.json() << "}";
+    sam.clearTracks();
+  }
+
+  // Loads from the cold tier of an embedding store holding a single uncompressed embedding (each
+  // load decompresses one and compresses the other), and mask pixels changed by the codec
+  if (FLAGS_decoder_runs > 0) {
+    std::vector<float> values, intermValues;
+    cv::Size imageSize;
+    sam.getEmbedding(values, intermValues, imageSize);
+    const cv::Point point(inputSize.width / 2, inputSize.height / 2);
+    const cv::Mat reference = sam.getMask(point);
+    const char* codecNames[] = {"float16", "int8"};
+    json << ", \"embedding_store\": {";
+    for (auto codec : {SamEmbeddingStore::kFloat16, SamEmbeddingStore::kInt8}) {
+      SamEmbeddingStore::Parameter storeParam;
+      storeParam.hotBytes = (values.size() + intermValues.size()) * sizeof(float);
+      storeParam.codec = codec;
+      SamEmbeddingStore store(storeParam);
+      store.put(0, values, intermValues, imageSize);
+      store.put(1, values, intermValues, imageSize);
+      Latency load;
+      for (int i = 0; i < FLAGS_decoder_runs; i++) {
+        start = Clock::now();
+        store.load(i % 2, sam);
+        load.ms.push_back(elapsedMs(start));
+      }
+      const auto storeStats = store.getStats();
+      json << (codec == SamEmbeddingStore::kFloat16 ? "" : ", ") << "\"" << codecNames[codec]
+           << "\": {\"load\": " << load.json() << ", \"hot_bytes\": " << storeStats.hotBytes
+           << ", \"cold_bytes\": " << storeStats.coldBytes
+           << ", \"mask_pixels_changed\": " << cv::countNonZero(sam.getMask(point) != reference)
+           << "}";
+    }
+    json << "}";
+  }
+
+  // Stage breakdown of all the runs above (encoder warm-up included)
+  const auto stats = sam.getStats();
+  const char* stageNames[] = {"input_packing", "encoder",       "decoder_input",
+                              "decoder",       "threshold",     "composite",
+                              "decoder_queue", "background_yield"};
+  json << ", \"stages\": {";
+  for (int i = 0; i < Sam::kNumStages; i++) {
+    const auto& stage = stats.stages[i];
+    json << (i > 0 ? ", " : "") << "\"" << stageNames[i] << "\": {\"runs\": " << stage.count
+         << ", \"mean_ms\": " << stage.meanMs() << ", \"p50_ms\": " << stage.percentileMs(50)
+         << ", \"p99_ms\": " << stage.percentileMs(99) << ", \"max_ms\": " << stage.maxMs << "}";
+  }
+  json << "}";
+
+  // Process wide, so only meaningful for the first set unless sets are run one per process
+  json << ", \"peak_rss_bytes\": " << peakRss() << "}";
+  return json.str();
+}
+
+int main(int argc, char** argv) {
+  gflags::ParseCommandLineNonHelpFlags(&argc, &argv, true);
+  if (FLAGS_h) {
+    std::cout << "Example: ./sam_cpp_bench -sets=\"sam,hq,edge\" -synthetic_dir=\"models/bench\" "
+                 "-output=\"bench.json\""
+              << std::endl;
+    return 0;
+  }
+
+  const auto& dir = FLAGS_synthetic_dir;
+  const std::vector<ModelSet> allSets = {
+      {"real", FLAGS_pre_model, FLAGS_sam_model, false},
+      {"sam", dir + "/sam_preprocess.onnx", dir + "/sam.onnx", true},
+      {"hq", dir + "/sam_hq_preprocess.onnx", dir + "/sam_hq.onnx", true},
+      {"edge", dir + "/edge_sam_encoder.onnx", dir + "/edge_sam_decoder.onnx", true},
+  };
+
+  std::vector<std::string> results;
+  for (const auto& set : allSets) {
+    if (("," + FLAGS_sets + ",").find("," + set.name + ",") == std::string::npos) {
+      continue;
+    }
+    if (!fileExists(set.preModel) || !fileExists(set.samModel)) {
+      std::cerr << "Skipping " << set.name << " (models not found"
+                << (set.bSynthetic ? ", run export_bench_models.py" : "") << ")" << std::endl;
+      continue;
+    }
+    std::cerr << "Running " << set.name << "..." << std::endl;
+    results.push_back(runBenchmark(set));
+  }
+
+  std::ofstream file;
+  if (!FLAGS_output.empty()) {
+    file.open(FLAGS_output);
+  }
+  std::ostream& out = FLAGS_output.empty() ? std::cout : file;
+  out << "{\"results\": [";
+  for (size_t i = 0; i < results.size(); i++) {
+    out << (i > 0 ? ",\n  " : "\n  ") << results[i];
+  }
+  out << "\n]}" << std::endl;
+
+  return results.empty() ? -1 : 0;
+}
@@ -0,0 +1,181 @@
+# Generate tiny stand-in models with the same inputs and outputs as the real ones, so that
+# sam_cpp_bench can run on any machine without downloading or exporting multi-GB models
+# Usage: python export_bench_models.py [output directory, default "models/bench"]
+# Only requires the onnx and numpy packages
+import os
+import sys
+
+import numpy as np
+import onnx
+from onnx import TensorProto, helper, numpy_helper
+
+output_dir = sys.argv[1] if len(sys.argv) > 1 else 'models/bench'
+
+# Same image size as export_pre_model.py
+image_size = (1024, 720)
+# The real models use 256 channels (64x64), HQ-SAM 4x1x64x64x1280 intermediate embeddings
+embedding_channels, embedding_size = 32, 64
+interm_shape = [4, 1, embedding_size, embedding_size, 16]
+opset = 17
+
+width, height = image_size
+rng = np.random.default_rng(0)
+
+
+def const(name, value):
+    return numpy_helper.from_array(np.asarray(value, dtype=np.float32), name)
+
+
+def const_int(name, value):
+    return numpy_helper.from_array(np.asarray(value, dtype=np.int64), name)
+
+
+def save(graph, path):
+    model = helper.make_model(graph, opset_imports=[helper.make_opsetid('', opset)])
+    model.ir_version = 8
+    onnx.checker.check_model(model)
+    onnx.save(model, os.path.join(output_dir, path))
+    print('Saved', os.path.join(output_dir, path))
+
+
+def encoder(input_name, output_name, input_type, hq):
+    # Downscale the image, then a few convolutions to have some realistic work to do
+    nodes, inits = [], []
+    x = input_name
+    if input_type == TensorProto.UINT8:
+        nodes.append(helper.make_node('Cast', [x], ['image_float'], to=TensorProto.FLOAT))
+        x = 'image_float'
+    inits += [const('resize_scales', [1, 1, embedding_size / height, embedding_size / width])]
+    nodes.append(helper.make_node('Resize', [x, '', 'resize_scales'], ['small'], mode='linear'))
+    x, channels = 'small', 3
+    for i, out_channels in enumerate([embedding_channels, embedding_channels, embedding_channels]):
+        weights = rng.normal(0, 0.1, (out_channels, channels, 3, 3)).astype(np.float32)
+        inits += [numpy_helper.from_array(weights, f'conv{i}_w'),
+                  const(f'conv{i}_b', np.zeros(out_channels))]
+        y = f'conv{i}'
+        nodes.append(helper.make_node('Conv', [x, f'conv{i}_w', f'conv{i}_b'], [y],
+                                      pads=[1, 1, 1, 1]))
+        nodes.append(helper.make_node('Relu', [y], [y + '_relu']))
+        x, channels = y + '_relu', out_channels
+    nodes.append(helper.make_node('Identity', [x], [output_name]))
+
+    outputs = [helper.make_tensor_value_info(
+        output_name, TensorProto.FLOAT, [1, embedding_channels, embedding_size, embedding_size])]
+    if hq:
+        # [1, C, E, E] -> [1, E, E, C] -> [4, 1, E, E, C / 4] (with C / 4 == interm_shape[4])
+        weights = rng.normal(0, 0.1, (interm_shape[0] * interm_shape[4], channels, 1, 1))
+        inits += [numpy_helper.from_array(weights.astype(np.float32), 'interm_w'),
+                  const_int('interm_shape_a', [interm_shape[0], interm_shape[4],
+                                               embedding_size, embedding_size])]
+        nodes += [helper.make_node('Conv', [x, 'interm_w'], ['interm_conv']),
+                  helper.make_node('Reshape', ['interm_conv', 'interm_shape_a'], ['interm_a']),
+                  helper.make_node('Transpose', ['interm_a'], ['interm_b'], perm=[0, 2, 3, 1]),
+                  helper.make_node('Unsqueeze', ['interm_b', 'axis1'], ['interm_embeddings'])]
+        inits.append(const_int('axis1', [1]))
+        outputs.append(helper.make_tensor_value_info(
+            'interm_embeddings', TensorProto.FLOAT, interm_shape))
+
+    inputs = [helper.make_tensor_value_info(input_name, input_type, [1, 3, height, width])]
+    return helper.make_graph(nodes, 'encoder', inputs, outputs, inits)
+
+
+def disk_logits(nodes, inits, prefix, grid_size, scale):
+    # Logits of a disk around the mean point of each prompt, radius depending on its position
+    grid_x = np.tile(np.arange(grid_size[0], dtype=np.float32) * width / grid_size[0],
+                     (grid_size[1], 1))
+    grid_y = np.tile((np.arange(grid_size[1], dtype=np.float32) * height / grid_size[1])[:, None],
+                     (1, grid_size[0]))
+    inits += [const(prefix + 'grid_x', grid_x[None, None]),
+              const(prefix + 'grid_y', grid_y[None, None]),
+              const(prefix + 'radius', 24 * scale), const(prefix + 'radius_step', 64 * scale)]
+    nodes += [
+        helper.make_node('Sub', [prefix + 'grid_x', 'cx'], [prefix + 'dx']),
+        helper.make_node('Sub', [prefix + 'grid_y', 'cy'], [prefix + 'dy']),
+        helper.make_node('Mul', [prefix + 'dx', prefix + 'dx'], [prefix + 'dx2']),
+        helper.make_node('Mul', [prefix + 'dy', prefix + 'dy'], [prefix + 'dy2']),
+        helper.make_node('Add', [prefix + 'dx2', prefix + 'dy2'], [prefix + 'd2']),
+        helper.make_node('Mod', ['cx', prefix + 'radius_step'], [prefix + 'r0'], fmod=1),
+        helper.make_node('Add', [prefix + 'r0', prefix + 'radius'], [prefix + 'r']),
+        helper.make_node('Mul', [prefix + 'r', prefix + 'r'], [prefix + 'r2']),
+        helper.make_node('Sub', [prefix + 'r2', prefix + 'd2'], [prefix + 'diff']),
+        helper.make_node('Div', [prefix + 'diff', prefix + 'r'], [prefix + 'raw']),
+        helper.make_node('Add', [prefix + 'raw', 'unused'], [prefix + 'logits']),
+    ]
+    return prefix + 'logits'
+
+
+def decoder(hq, edge):
+    nodes, inits = [], []
+    inputs = [helper.make_tensor_value_info(
+        'image_embeddings', TensorProto.FLOAT,
+        [1, embedding_channels, embedding_size, embedding_size])]
+    if hq:
+        inputs.append(helper.make_tensor_value_info(
+            'interm_embeddings', TensorProto.FLOAT, interm_shape))
+    inputs += [helper.make_tensor_value_info('point_coords', TensorProto.FLOAT,
+                                             ['batch', 'num_points', 2]),
+               helper.make_tensor_value_info('point_labels', TensorProto.FLOAT,
+                                             ['batch', 'num_points'])]
+    if not edge:
+        inputs += [helper.make_tensor_value_info('mask_input', TensorProto.FLOAT, [1, 1, 256, 256]),
+                   helper.make_tensor_value_info('has_mask_input', TensorProto.FLOAT, [1]),
+                   helper.make_tensor_value_info('orig_im_size', TensorProto.FLOAT, [2])]
+
+    # Every input contributes (with a zero weight) so that none is pruned from the graph
+    inits += [const('zero', 0), const('iou_base', 0.8), const('iou_step', 0.019),
+              const('ten', 10), const_int('x_start', [0]), const_int('y_start', [1]),
+              const_int('end_x', [1]), const_int('end_y', [2]),
+              const_int('shape_b111', [-1, 1, 1, 1])]
+    terms = []
+    for value in inputs:
+        if value.name == 'point_coords':
+            continue
+        nodes.append(helper.make_node('ReduceMean', [value.name], [value.name + '_mean'],
+                                      keepdims=0))
+        terms.append(value.name + '_mean')
+    nodes.append(helper.make_node('Sum', terms, ['inputs_sum']))
+    nodes.append(helper.make_node('Mul', ['inputs_sum', 'zero'], ['unused']))
+
+    # Mean point of each prompt -> [B, 1, 1, 1] coordinates
+    nodes += [
+        helper.make_node('ReduceMean', ['point_coords'], ['center'], axes=[1], keepdims=0),
+        helper.make_node('Slice', ['center', 'x_start', 'end_x', 'y_start'], ['cx_b']),
+        helper.make_node('Slice', ['center', 'end_x', 'end_y', 'y_start'], ['cy_b']),
+        helper.make_node('Reshape', ['cx_b', 'shape_b111'], ['cx']),
+        helper.make_node('Reshape', ['cy_b', 'shape_b111'], ['cy']),
+        # Predicted IoU in [0.8, 0.99] depending on the point, so that some masks are rejected
+        helper.make_node('Mod', ['cy_b', 'ten'], ['cy_mod'], fmod=1),
+        helper.make_node('Mul', ['cy_mod', 'iou_step'], ['iou_delta']),
+        helper.make_node('Add', ['iou_delta', 'iou_base'], ['iou']),
+    ]
+
+    if edge:
+        # EdgeSAM: 4 low resolution masks and scores per prompt
+        masks = [disk_logits(nodes, inits, f'm{i}_', (256, 256), 0.5 + 0.25 * i) for i in range(4)]
+        nodes += [helper.make_node('Concat', masks, ['masks'], axis=1),
+                  helper.make_node('Concat', ['iou'] * 4, ['scores'], axis=1)]
+        outputs = [helper.make_tensor_value_info('scores', TensorProto.FLOAT, ['batch', 4]),
+                   helper.make_tensor_value_info('masks', TensorProto.FLOAT,
+                                                 ['batch', 4, 256, 256])]
+    else:
+        full = disk_logits(nodes, inits, 'full_', (width, height), 1)
+        low = disk_logits(nodes, inits, 'low_', (256, 256), 1)
+        nodes += [helper.make_node('Identity', [full], ['masks']),
+                  helper.make_node('Identity', [low], ['low_res_masks']),
+                  helper.make_node('Identity', ['iou'], ['iou_predictions'])]
+        outputs = [helper.make_tensor_value_info('masks', TensorProto.FLOAT,
+                                                 ['batch', 1, height, width]),
+                   helper.make_tensor_value_info('iou_predictions', TensorProto.FLOAT,
+                                                 ['batch', 1]),
+                   helper.make_tensor_value_info('low_res_masks', TensorProto.FLOAT,
+                                                 ['batch', 1, 256, 256])]
+    return helper.make_graph(nodes, 'decoder', inputs, outputs, inits)
+
+
+os.makedirs(output_dir, exist_ok=True)
+save(encoder('input', 'output', TensorProto.UINT8, False), 'sam_preprocess.onnx')
+save(decoder(False, False), 'sam.onnx')
+save(encoder('input', 'output', TensorProto.UINT8, True), 'sam_hq_preprocess.onnx')
+save(decoder(True, False), 'sam_hq.onnx')
+save(encoder('image', 'image_embeddings', TensorProto.FLOAT, False), 'edge_sam_encoder.onnx')
+save(decoder(False, True), 'edge_sam_decoder.onnx')
@@ -2,23 +2,601 @@
 
 #include <onnxruntime_cxx_api.h>
 
+#include <algorithm>
+#include <bitset>
+#include <chrono>
+#include <cmath>
 #include <codecvt>
+#include <condition_variable>
+#include <deque>
+#include <filesystem>
 #include <fstream>
+#include <future>
 #include <iostream>
 #include <locale>
+#include <map>
 #include <mutex>
+#include <numeric>
 #include <opencv2/opencv.hpp>
+#include <random>
+#include <set>
+#include <sstream>
+#include <type_traits>
 #include <vector>
 
+#if _WIN32
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#if __linux__
+#include <sched.h>
+#endif
+
+namespace {
+
+#if _MSC_VER
+std::wstring toOrtPath(const std::string& path) {
+  std::wstring_convert<std::codecvt_utf8_utf16<wchar_t>> converter;
+  return converter.from_bytes(path);
+}
+#else
+std::string toOrtPath(const std::string& path) { return path; }
+#endif
+
+// CPUs of a list such as "0-3,8", empty if invalid
+std::vector<int> parseCpuSet(const std::string& text) {
+  std::vector<int> cpus;
+  std::istringstream stream(text);
+  std::string range;
+  while (std::getline(stream, range, ',')) {
+    std::istringstream rangeStream(range);
+    int first = -1, last = -1;
+    char dash = 0;
+    if (!(rangeStream >> first)) {
+      return {};
+    }
+    last = first;
+    if (rangeStream >> dash && (dash != '-' || !(rangeStream >> last))) {
+      return {};
+    }
+    if (first < 0 || last < first) {
+      return {};
+    }
+    for (int cpu = first; cpu <= last; cpu++) {
+      cpus.push_back(cpu);
+    }
+  }
+  return cpus;
+}
+
+// NUMA nodes of cpus, from sysfs (Linux only)
+std::set<int> numaNodes(const std::vector<int>& cpus) {
+  std::set<int> nodes;
+  for (int cpu : cpus) {
+    std::error_code error;
+    const auto path = "/sys/devices/system/cpu/cpu" + std::to_string(cpu);
+    for (const auto& entry : std::filesystem::directory_iterator(path, error)) {
+      const auto name = entry.path().filename().string();
+      if (name.size() > 4 && name.compare(0, 4, "node") == 0 && isdigit(name[4])) {
+        nodes.insert(std::stoi(name.substr(4)));
+      }
+    }
+  }
+  return nodes;
+}
+
+// Pins the calling thread to cpus until destruction (Linux only, nothing if cpus is empty), so
+// that it runs with the threads of a session and the memory it first touches meanwhile is
+// allocated on their NUMA node
+class ScopedAffinity {
+#if __linux__
+  cpu_set_t previous;
+  bool bPinned = false;
+#endif
+
+ public:
+  explicit ScopedAffinity(const std::vector<int>& cpus) {
+#if __linux__
+    if (cpus.empty() || sched_getaffinity(0, sizeof(previous), &previous) != 0) {
+      return;
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : cpus) {
+      if (cpu < CPU_SETSIZE) {
+        CPU_SET(cpu, &set);
+      }
+    }
+    bPinned = sched_setaffinity(0, sizeof(set), &set) == 0;
+#else
+    (void)cpus;
+#endif
+  }
+  ~ScopedAffinity() {
+#if __linux__
+    if (bPinned) {
+      sched_setaffinity(0, sizeof(previous), &previous);
+    }
+#endif
+  }
+};
+
+// Read-only mapping of a whole file, data is null if the file could not be mapped
+class MappedFile {
+  void* data_{nullptr};
+  size_t size_{0};
+#if _WIN32
+  HANDLE file_{INVALID_HANDLE_VALUE}, mapping_{nullptr};
+#endif
+
+ public:
+  explicit MappedFile(const std::string& path) {
+#if _WIN32
+    file_ = CreateFileW(toOrtPath(path).c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+                        OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    LARGE_INTEGER size;
+    if (file_ == INVALID_HANDLE_VALUE || !GetFileSizeEx(file_, &size) || size.QuadPart == 0) {
+      return;
+    }
+    mapping_ = CreateFileMappingW(file_, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (mapping_ != nullptr) {
+      data_ = MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0);
+      size_ = data_ != nullptr ? size_t(size.QuadPart) : 0;
+    }
+#else
+    const int fd = open(path.c_str(), O_RDONLY);
+    struct stat status;
+    if (fd >= 0 && fstat(fd, &status) == 0 && status.st_size > 0) {
+      void* data = mmap(nullptr, status.st_size, PROT_READ, MAP_SHARED, fd, 0);
+      if (data != MAP_FAILED) {
+        data_ = data;
+        size_ = status.st_size;
+      }
+    }
+    if (fd >= 0) {
+      close(fd);
+    }
+#endif
+  }
+  ~MappedFile() {
+#if _WIN32
+    if (data_ != nullptr) UnmapViewOfFile(data_);
+    if (mapping_ != nullptr) CloseHandle(mapping_);
+    if (file_ != INVALID_HANDLE_VALUE) CloseHandle(file_);
+#else
+    if (data_ != nullptr) munmap(data_, size_);
+#endif
+  }
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  const void* data() const { return data_; }
+  size_t size() const { return size_; }
+};
+
+// 64-bit FNV-1a
+uint64_t hashBytes(const void* data, size_t size, uint64_t hash = 14695981039346656037ull) {
+  const auto bytes = static_cast<const uint8_t*>(data);
+  for (size_t i = 0; i < size; i++) {
+    hash = (hash ^ bytes[i]) * 1099511628211ull;
+  }
+  return hash;
+}
+
+// Files of the tensors stored outside of a serialized ONNX model, from the location entries of
+// their external_data (StringStringEntryProto, key 1 and value 2)
+std::set<std::string> externalDataFiles(const char* data, size_t size) {
+  static const char tag[] = "\x0a\x08location\x12";
+  const char* end = data + size;
+  std::set<std::string> files;
+  for (const char* p = data; (p = std::search(p, end, tag, tag + sizeof(tag) - 1)) != end;) {
+    p += sizeof(tag) - 1;
+    size_t length = 0;
+    for (int shift = 0; p < end && shift < 64; shift += 7) {
+      const auto byte = uint8_t(*p++);
+      length |= size_t(byte & 0x7f) << shift;
+      if ((byte & 0x80) == 0) {
+        break;
+      }
+    }
+    if (length <= size_t(end - p)) {
+      files.emplace(p, length);
+      p += length;
+    }
+  }
+  return files;
+}
+
+// Name of the optimized version of a model in the cache, from a hash of the model size and
+// content (entirely up to 256 MB, then 1 MB out of every 64 MB as hashing multi-GB models would
+// cost much of the time saved, models with external data being small anyway), the sizes and
+// modification times of its external data files, the runtime version and the options changing
+// the optimized graph, buffer is used instead of the file at path if set
+std::string optimizedModelKey(const std::string& path, const Sam::Parameter::ModelBuffer& buffer,
+                              const Sam::Parameter::Provider& provider) {
+  const int64_t fullSize = int64_t(256) << 20, blockSize = 1 << 20, step = int64_t(64) << 20;
+  uint64_t hash = 0;
+  std::set<std::string> externalFiles;
+  if (buffer.data != nullptr) {
+    const int64_t size = buffer.size;
+    const bool bFull = size <= fullSize;
+    hash = hashBytes(&size, sizeof(size));
+    for (int64_t offset = 0; offset < size; offset += bFull ? size : step) {
+      hash = hashBytes(static_cast<const char*>(buffer.data) + offset,
+                       bFull ? size : std::min(blockSize, size - offset), hash);
+    }
+    if (bFull) {
+      externalFiles = externalDataFiles(static_cast<const char*>(buffer.data), size);
+    }
+  } else {
+    std::ifstream f(path, std::ios::binary | std::ios::ate);
+    const int64_t size = f.tellg();
+    const bool bFull = size <= fullSize;
+    hash = hashBytes(&size, sizeof(size));
+    std::vector<char> block(bFull ? std::max(size, int64_t(0)) : blockSize);
+    for (int64_t offset = 0; offset < size; offset += bFull ? size : step) {
+      f.seekg(offset);
+      f.read(block.data(), block.size());
+      hash = hashBytes(block.data(), f.gcount(), hash);
+      f.clear();
+    }
+    if (bFull) {
+      externalFiles = externalDataFiles(block.data(), block.size());
+    }
+  }
+  const auto directory = buffer.data != nullptr
+                             ? std::filesystem::path(buffer.externalDataDir)
+                             : std::filesystem::path(path).parent_path();
+  for (const auto& file : externalFiles) {
+    std::error_code error;
+    const auto filePath = directory / file;
+    const auto fileSize = std::filesystem::file_size(filePath, error);
+    const auto time = std::filesystem::last_write_time(filePath, error).time_since_epoch().count();
+    const auto entry = file + "|" + std::to_string(fileSize) + "|" + std::to_string(time);
+    hash = hashBytes(entry.data(), entry.size(), hash);
+  }
+
+  const auto options = std::string(OrtGetApiBase()->GetVersionString()) + "|" +
+                       std::to_string(ORT_ENABLE_EXTENDED) + "|" +
+                       std::to_string(provider.deviceType);
+  hash = hashBytes(options.data(), options.size(), hash);
+  char hex[17];
+  snprintf(hex, sizeof(hex), "%016llx", (unsigned long long)hash);
+  const auto name = buffer.data != nullptr ? std::string("buffer") : path;
+  return std::filesystem::path(name).stem().string() + "-" + hex;
+}
+
+// Bytes per pixel and offsets of the red, green and blue bytes of a pixel format, false if unknown
+bool pixelLayout(Sam::PixelFormat format, int& channels, int rgb[3]) {
+  switch (format) {
+    case Sam::kBGR:
+    case Sam::kBGRA:
+      channels = format == Sam::kBGR ? 3 : 4;
+      rgb[0] = 2, rgb[1] = 1, rgb[2] = 0;
+      return true;
+    case Sam::kRGB:
+    case Sam::kRGBA:
+      channels = format == Sam::kRGB ? 3 : 4;
+      rgb[0] = 0, rgb[1] = 1, rgb[2] = 2;
+      return true;
+    case Sam::kGray:
+      channels = 1;
+      rgb[0] = rgb[1] = rgb[2] = 0;
+      return true;
+  }
+  return false;
+}
+
+// Pack the ROI of an image into the planar RGB values of the encoder input in a single pass,
+// converting the pixel format on the way (float values are scaled to [0, 1])
+template <typename T>
+void packImage(const Sam::ImageView& image, const cv::Rect& roi, T* values) {
+  int channels = 0, rgb[3];
+  pixelLayout(image.format, channels, rgb);
+  const size_t planeSize = size_t(roi.width) * roi.height;
+  for (int i = 0; i < roi.height; i++) {
+    const uint8_t* src = static_cast<const uint8_t*>(image.data) + (roi.y + i) * image.step +
+                         roi.x * channels;
+    T* r = values + size_t(i) * roi.width;
+    T* g = r + planeSize;
+    T* b = g + planeSize;
+    for (int j = 0; j < roi.width; j++, src += channels) {
+      if constexpr (std::is_same<T, float>::value) {
+        r[j] = T(src[rgb[0]] / 255.f);
+        g[j] = T(src[rgb[1]] / 255.f);
+        b[j] = T(src[rgb[2]] / 255.f);
+      } else {
+        r[j] = src[rgb[0]];
+        g[j] = src[rgb[1]];
+        b[j] = src[rgb[2]];
+      }
+    }
+  }
+}
+
+// Closed polygons of the zero level set of logits by marching squares, the crossings being
+// interpolated linearly on the cell edges and the saddles resolved by the mean of the cell.
+// Outer boundaries are clockwise on screen and holes counterclockwise.
+std::vector<std::vector<cv::Point2f>> traceZeroLevel(const cv::Mat& logits) {
+  // A negative border closes the polygons touching the edges
+  cv::Mat padded;
+  cv::copyMakeBorder(logits, padded, 1, 1, 1, 1, cv::BORDER_CONSTANT, cv::Scalar(-1));
+  const int width = padded.cols;
+  // Edges crossed by the level set, 2 per grid point (horizontal, vertical), next[e] being the
+  // edge following e along its polygon
+  std::vector<int> next(size_t(2) * width * padded.rows, -1);
+  std::vector<cv::Point2f> crossings(next.size());
+  static const int cornerX[4] = {0, 1, 1, 0}, cornerY[4] = {0, 0, 1, 1};  // clockwise
+  for (int y = 0; y + 1 < padded.rows; y++) {
+    const float* row0 = padded.ptr<float>(y);
+    const float* row1 = padded.ptr<float>(y + 1);
+    for (int x = 0; x + 1 < width; x++) {
+      const float v[4] = {row0[x], row0[x + 1], row1[x + 1], row1[x]};
+      const bool inside[4] = {v[0] > 0, v[1] > 0, v[2] > 0, v[3] > 0};
+      if (inside[0] == inside[1] && inside[1] == inside[2] && inside[2] == inside[3]) {
+        continue;
+      }
+      // Crossed sides in clockwise order (top, right, bottom, left), exits going from an inside
+      // corner to an outside one
+      int edges[4], n = 0;
+      bool bExit[4];
+      for (int k = 0; k < 4; k++) {
+        const int q = (k + 1) % 4;
+        if (inside[k] == inside[q]) {
+          continue;
+        }
+        const int ex = x + (k == 1), ey = y + (k == 2);
+        const int edge = 2 * (ey * width + ex) + (k % 2);
+        const float t = v[k] / (v[k] - v[q]);
+        crossings[edge] = {x + cornerX[k] + t * (cornerX[q] - cornerX[k]) - 1,
+                           y + cornerY[k] + t * (cornerY[q] - cornerY[k]) - 1};
+        edges[n] = edge;
+        bExit[n++] = inside[k];
+      }
+      if (n == 2) {
+        const int from = bExit[0] ? 0 : 1;
+        next[edges[from]] = edges[1 - from];
+      } else {
+        // Saddle: an inside center cuts off the outside corners, an outside one the inside corners
+        const int step = v[0] + v[1] + v[2] + v[3] > 0 ? 1 : 3;
+        for (int i = 0; i < 4; i++) {
+          if (bExit[i]) next[edges[i]] = edges[(i + step) % 4];
+        }
+      }
+    }
+  }
+
+  std::vector<std::vector<cv::Point2f>> contours;
+  for (size_t start = 0; start < next.size(); start++) {
+    if (next[start] < 0) {
+      continue;
+    }
+    std::vector<cv::Point2f> contour;
+    for (int edge = start; next[edge] >= 0;) {
+      contour.push_back(crossings[edge]);
+      const int following = next[edge];
+      next[edge] = -1;
+      edge = following;
+    }
+    contours.push_back(std::move(contour));
+  }
+  return contours;
+}
+
+}  // namespace
+
+// The environment is a singleton of ONNX Runtime, its thread pools are those of the first one
+// created in the process, so it is shared by all instances
+struct SamEnvironment {
+  std::unique_ptr<Ort::Env> env;
+  bool bGlobalThreadPool = false, bCpuArenaRegistered = false;
+  std::mutex mutex;
+
+  static std::shared_ptr<SamEnvironment> get(const Sam::Parameter& param) {
+    static std::mutex instanceMutex;
+    static std::weak_ptr<SamEnvironment> instance;
+    std::lock_guard<std::mutex> lock(instanceMutex);
+    auto environment = instance.lock();
+    if (environment) {
+      if (param.globalThreadPool && !environment->bGlobalThreadPool) {
+        std::cerr << "Global thread pool ignored (environment already created without it)"
+                  << std::endl;
+      }
+      return environment;
+    }
+
+    environment = std::make_shared<SamEnvironment>();
+    if (param.globalThreadPool) {
+      Ort::ThreadingOptions threading;
+      threading.SetGlobalIntraOpNumThreads(param.threadsNumber);
+      threading.SetGlobalInterOpNumThreads(1);
+      environment->env = std::make_unique<Ort::Env>(threading, ORT_LOGGING_LEVEL_WARNING, "test");
+    } else {
+      environment->env = std::make_unique<Ort::Env>(ORT_LOGGING_LEVEL_WARNING, "test");
+    }
+    environment->bGlobalThreadPool = param.globalThreadPool;
+    instance = environment;
+    return environment;
+  }
+};
+
+// Shared by the instances created from the same Sam::SharedModel
+struct SamSharedModel {
+  std::shared_ptr<SamEnvironment> environment;  // set by the first instance
+  Ort::PrepackedWeightsContainer prepackedWeights;
+  std::mutex mutex;
+  // Sessions by model and options, alive as long as an instance uses them
+  struct Session {
+    std::weak_ptr<Ort::Session> session;
+    std::shared_future<std::shared_ptr<Ort::Session>> loading;  // set while being created
+  };
+  std::map<std::string, Session> sessions;
+};
+
 struct SamModel {
-  Ort::Env env{ORT_LOGGING_LEVEL_WARNING, "test"};
+  std::shared_ptr<SamSharedModel> shared;
   Ort::SessionOptions sessionOptions[2];
-  std::unique_ptr<Ort::Session> sessionPre, sessionSam;
+  std::shared_ptr<Ort::Session> sessionPre, sessionSam;
   std::vector<int64_t> inputShapePre, outputShapePre, intermShapePre;
   Ort::MemoryInfo memoryInfo{Ort::MemoryInfo::CreateCpu(OrtArenaAllocator, OrtMemTypeDefault)};
-  bool bModelLoaded = false, bSamHQ = false, bEdgeSam = false;
-  std::vector<float> outputTensorValuesPre, intermTensorValuesPre;
+  bool bSamHQ = false, bEdgeSam = false, bDecoderBatch = false;
+  bool bMaskInputBatch = false;  // mask_input has a dynamic batch axis too
+  bool bDecoderOnly = false;  // no preprocessing model, embeddings set with setEmbedding only
+  std::vector<int> cpus[2];  // CPU sets of the sessions, empty if not pinned
+
+  // Outputs of the preprocessing model for one image
+  struct Embedding {
+    std::vector<float> values, intermValues;
+    cv::Size imageSize;
+    // Embedding in memory of owner (e.g. shared memory) used instead of the vectors if set
+    std::shared_ptr<const void> owner;
+    const float* viewValues[2]{};  // values, intermValues
+    size_t viewSizes[2]{};
+    // Set when loaded, so that runs releasing the lock between decoder runs detect a new image
+    uint64_t version{0};
+
+    bool empty() const { return !owner && values.empty(); }
+    // i: 0 - values, 1 - intermValues
+    const float* data(int i) const {
+      return owner ? viewValues[i] : (i == 0 ? values : intermValues).data();
+    }
+    size_t size(int i) const {
+      return owner ? viewSizes[i] : (i == 0 ? values : intermValues).size();
+    }
+  } embedding;
+  const std::vector<float> maskInputValues = std::vector<float>(256 * 256, 0.f);
   mutable std::recursive_mutex recursive_mutex;
+  uint64_t nextEmbeddingVersion{1};
+
+  // Objects tracked across frames with their low resolution logits on the last frame, fed back
+  // as mask_input (empty if the decoder has none)
+  struct Track {
+    Sam::Track info;
+    std::vector<float> lowRes;
+  };
+  std::vector<Track> tracks;
+  int nextTrackId{1};
+
+  // Counters of Sam::getStats, atomic so that stages running on other threads (background
+  // encoding of crops) record without locking
+  struct StageCounter {
+    std::atomic<int64_t> count{0}, totalNs{0}, maxNs{0}, histogram[Sam::StageStats::kBuckets]{};
+
+    void add(int64_t ns) {
+      count++;
+      totalNs += ns;
+      int64_t max = maxNs;
+      while (ns > max && !maxNs.compare_exchange_weak(max, ns)) {
+      }
+      int bucket = 0;
+      for (int64_t us = ns / 1000; us > 0 && bucket < Sam::StageStats::kBuckets - 1; us >>= 1) {
+        bucket++;
+      }
+      histogram[bucket]++;
+    }
+    void reset() {
+      count = 0;
+      totalNs = 0;
+      maxNs = 0;
+      for (auto& v : histogram) {
+        v = 0;
+      }
+    }
+  };
+  mutable StageCounter stageCounters[Sam::kNumStages];
+  mutable std::atomic<int64_t> encodedImages{0}, decodedPrompts{0};
+
+  // Adds the time from construction to stop() (or destruction) to a stage counter
+  class StageTimer {
+    StageCounter* counter;
+    std::chrono::steady_clock::time_point start{std::chrono::steady_clock::now()};
+
+   public:
+    explicit StageTimer(StageCounter* counter) : counter(counter) {}
+    ~StageTimer() { stop(); }
+    void stop() {
+      if (counter != nullptr) {
+        counter->add(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                         std::chrono::steady_clock::now() - start)
+                         .count());
+        counter = nullptr;
+      }
+    }
+  };
+  // Not recorded unless bRecord (e.g. internal warm-up runs)
+  StageTimer timeStage(Sam::Stage stage, bool bRecord = true) const {
+    return StageTimer(bRecord ? &stageCounters[stage] : nullptr);
+  }
+
+  // getMask prompt, decoded with the concurrent prompts of the same size
+  struct DecoderRequest {
+    std::vector<float> pointValues, labelValues;
+    cv::Mat* mask{nullptr};
+    double iou{0};
+    bool bDone{false}, bOk{false};
+    std::exception_ptr exception;  // thrown by the run of the request
+    std::chrono::steady_clock::time_point queued;
+  };
+  int maxBatchSize{1};
+  std::chrono::microseconds batchWindow{0};
+  mutable std::mutex batchMutex;
+  mutable std::condition_variable batchCondition;
+  mutable std::deque<DecoderRequest*> batchQueue;
+  mutable bool bBatchRunning{false};
+  mutable std::atomic<int64_t> batchSizes[Sam::Stats::kBatchSizeBuckets]{};
+
+  // Interactive calls pending, background decoder runs wait for them up to backgroundYield
+  std::chrono::milliseconds backgroundYield{0};
+  mutable std::mutex priorityMutex;
+  mutable std::condition_variable priorityCondition;
+  mutable int interactivePending{0};
+
+  class InteractiveScope {
+    const SamModel& model;
+
+   public:
+    explicit InteractiveScope(const SamModel& model) : model(model) {
+      std::lock_guard<std::mutex> lock(model.priorityMutex);
+      model.interactivePending++;
+    }
+    ~InteractiveScope() {
+      std::lock_guard<std::mutex> lock(model.priorityMutex);
+      if (--model.interactivePending == 0) {
+        model.priorityCondition.notify_all();
+      }
+    }
+  };
+
+  void yieldToInteractive() const {
+    std::unique_lock<std::mutex> lock(priorityMutex);
+    if (interactivePending == 0) {
+      return;
+    }
+    auto timer = timeStage(Sam::kBackgroundYield);
+    priorityCondition.wait_for(lock, backgroundYield, [&] { return interactivePending == 0; });
+  }
+
+  // Memory accounting and arena shrinkage requests (0 - embedding, 1 - segmentation)
+  size_t weightsBytes = 0;
+  bool bSharedArena = false;
+  mutable std::atomic<size_t> decoderOutputBytes{0};
+  mutable std::atomic<bool> shrinkPending[2]{};
+  std::string shrinkDevices[2];
+
+  // Run options of a session, with an arena shrinkage request if one is pending
+  Ort::RunOptions runOptions(int i) const {
+    Ort::RunOptions options;
+    if (shrinkPending[i].exchange(false)) {
+      options.AddConfigEntry("memory.enable_memory_arena_shrinkage", shrinkDevices[i].c_str());
+    }
+    return options;
+  }
 
   char *inputNamesSam[6]{"image_embeddings", "point_coords",   "point_labels",
                          "mask_input",       "has_mask_input", "orig_im_size"},
@@ -28,21 +606,114 @@ struct SamModel {
       *outputNamesSam[3]{"masks", "iou_predictions", "low_res_masks"},
       *outputNamesEdgeSam[2]{"scores", "masks"};
 
-  SamModel(const Sam::Parameter& param) {
-    for (auto& p : param.models) {
-      std::ifstream f(p);
+  // Loading state, true once loaded (false if loading failed), the loading threads are joined
+  // before the members they set are destroyed
+  std::shared_future<bool> decoderLoaded, modelLoaded;
+
+  // Start loading both models in the background
+  SamModel(const Sam::Parameter& param, const Sam::SharedModel& sharedModel)
+      : shared(sharedModel ? sharedModel : std::make_shared<SamSharedModel>()),
+        bDecoderOnly(param.models[0].empty() && param.modelBuffers[0].data == nullptr),
+        maxBatchSize(param.maxBatchSize),
+        batchWindow(param.batchWindowUs),
+        backgroundYield(param.backgroundYieldMs) {
+    for (int i = bDecoderOnly ? 1 : 0; i < 2; i++) {
+      if (param.modelBuffers[i].data != nullptr) {
+        weightsBytes += param.modelBuffers[i].size;
+        continue;
+      }
+      const auto& p = param.models[i];
+      std::ifstream f(p, std::ios::binary | std::ios::ate);
       if (!f.good()) {
         std::cerr << "Model file " << p << " not found" << std::endl;
+        std::promise<bool> failed;
+        failed.set_value(false);
+        decoderLoaded = modelLoaded = failed.get_future().share();
         return;
       }
+      weightsBytes += f.tellg();
+    }
+
+    std::shared_ptr<SamEnvironment> environment;
+    {
+      std::lock_guard<std::mutex> lock(shared->mutex);
+      if (!shared->environment) {
+        shared->environment = SamEnvironment::get(param);
+      }
+      environment = shared->environment;
+    }
+    const bool bGlobalThreadPool = param.globalThreadPool && environment->bGlobalThreadPool;
+
+    const auto& memory = param.memory;
+    if (memory.cpuArena && (sharedModel || memory.arenaExtendStrategy != 0)) {
+      // The CPU arena can only be configured, or shared between sessions, as an allocator of the
+      // environment (configured by the first instance needing it)
+      std::lock_guard<std::mutex> lock(environment->mutex);
+      if (!environment->bCpuArenaRegistered) {
+        Ort::ArenaCfg arenaCfg(0, memory.arenaExtendStrategy, -1, -1);
+        environment->env->CreateAndRegisterAllocator(memoryInfo, arenaCfg);
+        environment->bCpuArenaRegistered = true;
+      }
+      bSharedArena = true;
     }
 
     for (int i = 0; i < 2; i++) {
       auto& provider = param.providers[i];
       auto& option = sessionOptions[i];
 
-      option.SetIntraOpNumThreads(param.threadsNumber);
+      const auto& cpuSet = param.cpuSets[i];
+      cpus[i] = parseCpuSet(cpuSet);
+      if (!cpuSet.empty() && cpus[i].empty()) {
+        std::cerr << "Invalid CPU set " << cpuSet << std::endl;
+      }
+#if !__linux__
+      if (!cpus[i].empty()) {
+        std::cerr << "CPU sets are only supported on Linux" << std::endl;
+        cpus[i].clear();
+      }
+#endif
+
+      if (bGlobalThreadPool) {
+        option.DisablePerSessionThreads();
+      } else if (!cpus[i].empty()) {
+        // The pool threads (all but the calling one, pinned during runs) may run on any CPU of the
+        // set, numbered from 1 by the runtime
+        const int threadsNumber = param.threadsNumber > 0 ? param.threadsNumber : cpus[i].size();
+        std::string cpuList;
+        for (int cpu : cpus[i]) {
+          cpuList += (cpuList.empty() ? "" : ",") + std::to_string(cpu + 1);
+        }
+        std::string affinities;
+        for (int t = 1; t < threadsNumber; t++) {
+          affinities += (t > 1 ? ";" : "") + cpuList;
+        }
+        option.SetIntraOpNumThreads(threadsNumber);
+        if (!affinities.empty()) {
+          option.AddConfigEntry("session.intra_op_thread_affinities", affinities.c_str());
+        }
+      } else {
+        option.SetIntraOpNumThreads(param.threadsNumber);
+      }
+
+      if (!cpus[i].empty()) {
+        std::string nodes;
+        for (int node : numaNodes(cpus[i])) {
+          nodes += (nodes.empty() ? "" : ", ") + std::to_string(node);
+        }
+        std::cerr << (i == 0 ? "Preprocessing" : "Sam") << " model threads on CPUs " << cpuSet
+                  << " (NUMA node " << (nodes.empty() ? "unknown" : nodes) << ")"
+                  << (bGlobalThreadPool ? ", except the global thread pool" : "") << std::endl;
+      }
       option.SetGraphOptimizationLevel(GraphOptimizationLevel::ORT_ENABLE_ALL);
+      if (!memory.cpuArena) {
+        option.DisableCpuMemArena();
+      } else if (bSharedArena) {
+        option.AddConfigEntry("session.use_env_allocators", "1");
+      }
+      if (!memory.memoryPattern) {
+        option.DisableMemPattern();
+      }
+      shrinkDevices[i] = "cpu:0";
 
       if (provider.deviceType == 1) {
         OrtCUDAProviderOptions options;
@@ -50,104 +721,395 @@ struct SamModel {
         if (provider.gpuMemoryLimit > 0) {
           options.gpu_mem_limit = provider.gpuMemoryLimit;
         }
+        options.arena_extend_strategy = memory.arenaExtendStrategy;
+        shrinkDevices[i] += ";gpu:" + std::to_string(provider.gpuDeviceId);
         option.AppendExecutionProvider_CUDA(options);
       }
     }
 
-#if _MSC_VER
-    std::wstring_convert<std::codecvt_utf8_utf16<wchar_t>> converter;
-    auto wpreModelPath = converter.from_bytes(param.models[0]);
-    auto wsamModelPath = converter.from_bytes(param.models[1]);
-#else
-    auto wpreModelPath = param.models[0];
-    auto wsamModelPath = param.models[1];
-#endif
+    // The sessions are independent and created in parallel, unless the decoder goes first
+    std::shared_future<bool> encoderLoaded;
+    decoderLoaded = std::async(std::launch::async, [this, param] { return loadDecoder(param); });
+    if (bDecoderOnly) {
+      modelLoaded = decoderLoaded;
+      return;
+    }
+    if (param.decoderFirst) {
+      encoderLoaded = std::async(std::launch::async, [this, param, decoder = decoderLoaded] {
+        decoder.wait();
+        return loadEncoder(param);
+      });
+    } else {
+      encoderLoaded = std::async(std::launch::async, [this, param] { return loadEncoder(param); });
+    }
+    modelLoaded = std::async(std::launch::async, [this, decoder = decoderLoaded, encoderLoaded] {
+      return decoder.get() && encoderLoaded.get() && checkModels();
+    });
+  }
+
+  ~SamModel() {
+    if (modelLoaded.valid()) {
+      modelLoaded.wait();
+    }
+  }
 
-    sessionPre = std::make_unique<Ort::Session>(env, wpreModelPath.c_str(), sessionOptions[0]);
-    int targetNumber[]{1, 6};
+  // Returns the state of a loading future, waiting for it unless bWait is false (then false is
+  // returned while loading), loading exceptions are reported as a failure
+  static bool isLoaded(const std::shared_future<bool>& loaded, bool bWait = true) {
+    if (!bWait && loaded.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+      return false;
+    }
+    try {
+      return loaded.get();
+    } catch (...) {
+      return false;
+    }
+  }
+
+  bool loadDecoder(const Sam::Parameter& param) {
+    sessionSam = loadSession(param, 1);
+    const auto inputCount = sessionSam->GetInputCount();
+    const auto outputCount = sessionSam->GetOutputCount();
+    bEdgeSam = outputCount == 2;
+    bSamHQ = !bEdgeSam && inputCount == 7;
+    if (inputCount != (bEdgeSam ? 3 : bSamHQ ? 7 : 6) || (outputCount != 3 && !bEdgeSam)) {
+      std::cerr << "Model not loaded (invalid input/output count)" << std::endl;
+      return false;
+    }
+
+    // The embedding shape is taken from the decoder, so that embeddings can be decoded before the
+    // preprocessing model is loaded
+    outputShapePre = sessionSam->GetInputTypeInfo(0).GetTensorTypeAndShapeInfo().GetShape();
+    const bool bDynamic =
+        std::any_of(outputShapePre.begin(), outputShapePre.end(), [](int64_t v) { return v < 0; });
+    if (outputShapePre.size() != 4 || bDynamic) {
+      std::cerr << "Model not loaded (invalid embedding shape)" << std::endl;
+      return false;
+    }
 
-    bSamHQ = sessionPre->GetOutputCount() == 2;
     if (bSamHQ) {
-      for (auto& v : targetNumber) {
-        v++;
+      intermShapePre = sessionSam->GetInputTypeInfo(1).GetTensorTypeAndShapeInfo().GetShape();
+      if (intermShapePre.size() != 5) {
+        std::cerr << "Model not loaded (invalid interm shape)" << std::endl;
+        return false;
       }
     }
 
-    if (sessionPre->GetInputCount() != 1 || sessionPre->GetOutputCount() != targetNumber[0]) {
+    // Decoders exported with a dynamic batch axis on point_coords can take several prompts per run
+    const auto pointShape =
+        sessionSam->GetInputTypeInfo(bSamHQ ? 2 : 1).GetTensorTypeAndShapeInfo().GetShape();
+    bDecoderBatch = pointShape.size() == 3 && pointShape[0] < 0;
+    if (!bEdgeSam) {
+      const auto maskShape =
+          sessionSam->GetInputTypeInfo(bSamHQ ? 4 : 3).GetTensorTypeAndShapeInfo().GetShape();
+      bMaskInputBatch = maskShape.size() == 4 && maskShape[0] < 0;
+    }
+    return true;
+  }
+
+  bool loadEncoder(const Sam::Parameter& param) {
+    sessionPre = loadSession(param, 0);
+    const auto outputCount = sessionPre->GetOutputCount();
+    if (sessionPre->GetInputCount() != 1 || (outputCount != 1 && outputCount != 2)) {
       std::cerr << "Preprocessing model not loaded (invalid input/output count)" << std::endl;
-      return;
+      return false;
     }
 
-    sessionSam = std::make_unique<Ort::Session>(env, wsamModelPath.c_str(), sessionOptions[1]);
-    const auto samOutputCount = sessionSam->GetOutputCount();
+    inputShapePre = sessionPre->GetInputTypeInfo(0).GetTensorTypeAndShapeInfo().GetShape();
+    if (inputShapePre.size() != 4) {
+      std::cerr << "Preprocessing model not loaded (invalid shape)" << std::endl;
+      return false;
+    }
+    return true;
+  }
+
+  // Both models are loaded, check that the outputs of one are the inputs of the other
+  bool checkModels() const {
+    if ((sessionPre->GetOutputCount() == 2) != bSamHQ) {
+      std::cerr << "Preprocessing model not loaded (invalid input/output count)" << std::endl;
+      return false;
+    }
+    if (sessionPre->GetOutputTypeInfo(0).GetTensorTypeAndShapeInfo().GetShape() != outputShapePre) {
+      std::cerr << "Preprocessing model not loaded (invalid shape)" << std::endl;
+      return false;
+    }
+    return true;
+  }
 
-    bEdgeSam = samOutputCount == 2;
-    if (bEdgeSam) {
-      targetNumber[1] = 3;
+  // Session of model i, shared with the instances of the same shared model using the same model
+  // and options
+  std::shared_ptr<Ort::Session> loadSession(const Sam::Parameter& param, int i) {
+    const auto& provider = param.providers[i];
+    const auto& memory = param.memory;
+    std::ostringstream key;
+    key << param.models[i] << "|" << param.modelBuffers[i].data << param.mapModels << "|"
+        << provider.deviceType << "|" << provider.gpuDeviceId << "|" << provider.gpuMemoryLimit
+        << "|" << param.threadsNumber << param.globalThreadPool << "|" << param.cpuSets[i] << "|"
+        << memory.cpuArena << memory.arenaExtendStrategy << memory.memoryPattern << "|"
+        << param.cacheDir;
+
+    // Created outside of the lock, so that other sessions load in parallel
+    std::unique_lock<std::mutex> lock(shared->mutex);
+    auto& entry = shared->sessions[key.str()];
+    if (auto existing = entry.session.lock()) {
+      return existing;
     }
+    if (entry.loading.valid()) {
+      auto loading = entry.loading;
+      lock.unlock();
+      return loading.get();
+    }
+    std::promise<std::shared_ptr<Ort::Session>> promise;
+    entry.loading = promise.get_future().share();
+    lock.unlock();
 
-    if (sessionSam->GetInputCount() != targetNumber[1] || (samOutputCount != 3 && !bEdgeSam)) {
-      std::cerr << "Model not loaded (invalid input/output count)" << std::endl;
-      return;
+    std::shared_ptr<Ort::Session> session;
+    std::exception_ptr exception;
+    try {
+      session = createSession(param, i);
+      promise.set_value(session);
+    } catch (...) {
+      exception = std::current_exception();
+      promise.set_exception(exception);
+    }
+    lock.lock();
+    entry.session = session;
+    entry.loading = {};
+    lock.unlock();
+    if (exception) {
+      std::rethrow_exception(exception);
     }
+    return session;
+  }
 
-    inputShapePre = sessionPre->GetInputTypeInfo(0).GetTensorTypeAndShapeInfo().GetShape();
-    outputShapePre = sessionPre->GetOutputTypeInfo(0).GetTensorTypeAndShapeInfo().GetShape();
-    if (inputShapePre.size() != 4 || outputShapePre.size() != 4) {
-      std::cerr << "Preprocessing model not loaded (invalid shape)" << std::endl;
-      return;
+  // Load model i, through its optimized version in param.cacheDir if set (written on first load)
+  std::unique_ptr<Ort::Session> createSession(const Sam::Parameter& param, int i) {
+    namespace fs = std::filesystem;
+    auto& env = *shared->environment->env;
+    const auto& modelPath = param.models[i];
+    if (param.cacheDir.empty()) {
+      return openModel(param, i, sessionOptions[i]);
     }
 
-    if (bSamHQ) {
-      intermShapePre = sessionSam->GetInputTypeInfo(1).GetTensorTypeAndShapeInfo().GetShape();
-      if (intermShapePre.size() != 5) {
-        std::cerr << "Model not loaded (invalid interm shape)" << std::endl;
-        return;
+    // Saved at ORT_ENABLE_EXTENDED: the layout optimizations of ORT_ENABLE_ALL depend on the CPU
+    // (e.g. NCHWc blocks of its vector width), so they are applied on load and the cache can be
+    // shared by machines of different CPU types
+    const auto key = optimizedModelKey(modelPath, param.modelBuffers[i], param.providers[i]);
+    const auto cachedPath = (fs::path(param.cacheDir) / (key + ".onnx")).string();
+    std::error_code error;
+    auto loadCached = [&]() -> std::unique_ptr<Ort::Session> {
+      if (!fs::exists(cachedPath, error)) {
+        return nullptr;
       }
+      try {
+        return std::make_unique<Ort::Session>(env, toOrtPath(cachedPath).c_str(),
+                                              sessionOptions[i], shared->prepackedWeights);
+      } catch (const Ort::Exception& e) {
+        std::cerr << "Invalid cached model " << cachedPath << " (" << e.what() << ")" << std::endl;
+        fs::remove(cachedPath, error);
+        return nullptr;
+      }
+    };
+    if (auto session = loadCached()) {
+      return session;
+    }
+
+    // Written under a temporary name then renamed, so that concurrent processes never load a
+    // partial file, weights are saved apart since protobuf is limited to 2 GB
+    fs::create_directories(param.cacheDir, error);
+    const auto tempName = key + "." + std::to_string(std::random_device()());
+    const auto tempPath = (fs::path(param.cacheDir) / (tempName + ".onnx")).string();
+    const auto dataName = tempName + ".data";
+    auto option = sessionOptions[i].Clone();
+    option.SetGraphOptimizationLevel(GraphOptimizationLevel::ORT_ENABLE_EXTENDED);
+    option.SetOptimizedModelFilePath(toOrtPath(tempPath).c_str());
+    option.AddConfigEntry("session.optimized_model_external_initializers_file_name",
+                          dataName.c_str());
+    option.AddConfigEntry("session.optimized_model_external_initializers_min_size_in_bytes",
+                          "1024");
+    openModel(param, i, option);
+    fs::rename(tempPath, cachedPath, error);
+    if (error) {
+      std::cerr << "Unable to write cached model " << cachedPath << std::endl;
+      fs::remove(tempPath, error);
+      fs::remove(fs::path(param.cacheDir) / dataName, error);
+    } else if (auto session = loadCached()) {
+      return session;
     }
+    return openModel(param, i, sessionOptions[i]);
+  }
+
+  // Create a session of model i from its buffer if set, else from its file (mapped if
+  // param.mapModels), the runtime copies what it keeps so the bytes are only needed while loading
+  std::unique_ptr<Ort::Session> openModel(const Sam::Parameter& param, int i,
+                                          const Ort::SessionOptions& option) {
+    auto& env = *shared->environment->env;
+    const auto& path = param.models[i];
+    const auto& buffer = param.modelBuffers[i];
+
+    // Models loaded from memory have no directory to resolve the paths of external data files
+    auto withDataDir = [&](const std::string& dir) {
+      auto dataOption = option.Clone();
+      if (!dir.empty()) {
+        dataOption.AddConfigEntry("session.model_external_initializers_file_folder_path",
+                                  dir.c_str());
+      }
+      return dataOption;
+    };
 
-    bModelLoaded = true;
+    if (buffer.data != nullptr) {
+      return std::make_unique<Ort::Session>(env, buffer.data, buffer.size,
+                                            withDataDir(buffer.externalDataDir),
+                                            shared->prepackedWeights);
+    }
+    if (param.mapModels) {
+      MappedFile file(path);
+      if (file.data() != nullptr) {
+        const auto dir = std::filesystem::absolute(path).parent_path().string();
+        return std::make_unique<Ort::Session>(env, file.data(), file.size(), withDataDir(dir),
+                                              shared->prepackedWeights);
+      }
+      std::cerr << "Unable to map " << path << ", reading it instead" << std::endl;
+    }
+    return std::make_unique<Ort::Session>(env, toOrtPath(path).c_str(), option,
+                                          shared->prepackedWeights);
   }
 
+  // Size of the image of the loaded embedding, that of the masks, and its version
+  cv::Size getImageSize(uint64_t* version = nullptr) const {
+    std::lock_guard<std::recursive_mutex> lock(recursive_mutex);
+    if (version != nullptr) {
+      *version = embedding.version;
+    }
+    return embedding.imageSize;
+  }
+  // Size of the loaded image until the preprocessing model is loaded (or without it)
   cv::Size getInputSize() const {
-    if (!bModelLoaded) return cv::Size(0, 0);
+    if (bDecoderOnly || !isLoaded(modelLoaded, false)) return getImageSize();
     return cv::Size(inputShapePre[3], inputShapePre[2]);
   }
+
+  static int64_t shapeCount(const std::vector<int64_t>& shape) {
+    return std::accumulate(shape.begin(), shape.end(), int64_t(1), std::multiplies<int64_t>());
+  }
+
+  // The image is encoded aside, concurrent decoder runs use the previous embedding until it is
+  // replaced (and released outside of the lock)
   bool loadImage(const cv::Mat& image) {
-    if (image.size() != cv::Size(inputShapePre[3], inputShapePre[2])) {
-      std::cerr << "Image size not match" << std::endl;
+    Embedding encoded;
+    return encode(image, encoded) && replaceEmbedding(encoded);
+  }
+  bool loadImage(const Sam::ImageView& image) {
+    Embedding encoded;
+    return encode(image, encoded) && replaceEmbedding(encoded);
+  }
+  bool replaceEmbedding(Embedding& encoded) {
+    std::lock_guard<std::recursive_mutex> lock(recursive_mutex);
+    encoded.version = nextEmbeddingVersion++;
+    std::swap(embedding, encoded);
+    return true;
+  }
+
+  bool setEmbedding(const std::vector<float>& values, const std::vector<float>& intermValues,
+                    const cv::Size& imageSize) {
+    if (!isLoaded(decoderLoaded)) {
+      std::cerr << "Model not loaded" << std::endl;
       return false;
     }
-    if (image.channels() != 3) {
-      std::cerr << "Input is not a 3-channel image" << std::endl;
+    if (int64_t(values.size()) != shapeCount(outputShapePre) ||
+        (bSamHQ && int64_t(intermValues.size()) != shapeCount(intermShapePre)) ||
+        imageSize.empty()) {
+      std::cerr << "Embedding size not match" << std::endl;
       return false;
     }
 
-    std::vector<uint8_t> inputTensorValuesInt;
-    std::vector<float> inputTensorValuesFloat;
+    std::lock_guard<std::recursive_mutex> lock(recursive_mutex);
+    ScopedAffinity affinity(cpus[1]);
+    embedding.owner.reset();
+    embedding.values = values;
+    embedding.intermValues = bSamHQ ? intermValues : std::vector<float>();
+    embedding.imageSize = imageSize;
+    embedding.version = nextEmbeddingVersion++;
+    return true;
+  }
+
+  bool setEmbedding(const float* values, size_t numValues, const float* intermValues,
+                    size_t numIntermValues, const cv::Size& imageSize,
+                    const std::shared_ptr<const void>& owner) {
+    if (!isLoaded(decoderLoaded)) {
+      std::cerr << "Model not loaded" << std::endl;
+      return false;
+    }
+    if (values == nullptr || int64_t(numValues) != shapeCount(outputShapePre) ||
+        (bSamHQ && (intermValues == nullptr ||
+                    int64_t(numIntermValues) != shapeCount(intermShapePre))) ||
+        imageSize.empty() || !owner) {
+      std::cerr << "Embedding size not match" << std::endl;
+      return false;
+    }
+
+    std::lock_guard<std::recursive_mutex> lock(recursive_mutex);
+    embedding.values = std::vector<float>();
+    embedding.intermValues = std::vector<float>();
+    embedding.owner = owner;
+    embedding.viewValues[0] = values;
+    embedding.viewValues[1] = bSamHQ ? intermValues : nullptr;
+    embedding.viewSizes[0] = numValues;
+    embedding.viewSizes[1] = bSamHQ ? numIntermValues : 0;
+    embedding.imageSize = imageSize;
+    embedding.version = nextEmbeddingVersion++;
+    return true;
+  }
 
-#define SetInput(inputTensorValues)                                                           \
-  inputTensorValues.resize(inputShapePre[0] * inputShapePre[1] * inputShapePre[2] *           \
-                           inputShapePre[3]);                                                 \
-  for (int i = 0; i < inputShapePre[2]; i++) {                                                \
-    for (int j = 0; j < inputShapePre[3]; j++) {                                              \
-      inputTensorValues[i * inputShapePre[3] + j] = image.at<cv::Vec3b>(i, j)[2];             \
-      inputTensorValues[inputShapePre[2] * inputShapePre[3] + i * inputShapePre[3] + j] =     \
-          image.at<cv::Vec3b>(i, j)[1];                                                       \
-      inputTensorValues[2 * inputShapePre[2] * inputShapePre[3] + i * inputShapePre[3] + j] = \
-          image.at<cv::Vec3b>(i, j)[0];                                                       \
-    }                                                                                         \
-  }                                                                                           \
-  if (bEdgeSam) {                                                                             \
-    for (auto& v : inputTensorValues) {                                                       \
-      v /= 255.;                                                                              \
-    }                                                                                         \
+  // 8-bit BGR, BGRA or grayscale image (any step, e.g. a ROI of a larger image)
+  bool encode(const cv::Mat& image, Embedding& output) const {
+    if (image.depth() != CV_8U ||
+        (image.channels() != 1 && image.channels() != 3 && image.channels() != 4)) {
+      std::cerr << "Input is not an 8-bit gray, BGR or BGRA image" << std::endl;
+      return false;
+    }
+    Sam::ImageView view;
+    view.data = image.data;
+    view.size = image.size();
+    view.step = image.step;
+    view.format =
+        image.channels() == 1 ? Sam::kGray : (image.channels() == 3 ? Sam::kBGR : Sam::kBGRA);
+    return encode(view, output);
   }
 
+  // Run the preprocessing model on image, safe to call concurrently with decoder runs on other
+  // embeddings
+  bool encode(const Sam::ImageView& image, Embedding& output) const {
+    if (bDecoderOnly || !isLoaded(modelLoaded)) {
+      std::cerr << "Model not loaded" << std::endl;
+      return false;
+    }
+    int channels = 0, rgb[3];
+    const cv::Rect roi = image.roi.empty() ? cv::Rect(cv::Point(), image.size) : image.roi;
+    if (image.data == nullptr || !pixelLayout(image.format, channels, rgb) ||
+        image.step < size_t(image.size.width) * channels ||
+        (roi & cv::Rect(cv::Point(), image.size)) != roi) {
+      std::cerr << "Invalid image view" << std::endl;
+      return false;
+    }
+    if (roi.size() != cv::Size(inputShapePre[3], inputShapePre[2])) {
+      std::cerr << "Image size not match" << std::endl;
+      return false;
+    }
+
+    ScopedAffinity affinity(cpus[0]);
+    auto packing = timeStage(Sam::kInputPacking);
+    output.imageSize = roi.size();
+    std::vector<uint8_t> inputTensorValuesInt;
+    std::vector<float> inputTensorValuesFloat;
+    const size_t inputSize =
+        inputShapePre[0] * inputShapePre[1] * inputShapePre[2] * inputShapePre[3];
     if (!bEdgeSam) {
-      SetInput(inputTensorValuesInt);
+      inputTensorValuesInt.resize(inputSize);
+      packImage(image, roi, inputTensorValuesInt.data());
     } else {
-      SetInput(inputTensorValuesFloat);
+      inputTensorValuesFloat.resize(inputSize);
+      packImage(image, roi, inputTensorValuesFloat.data());
     }
 
 #define InputTensor(inputTensorValues, type)                                                     \
@@ -159,55 +1121,435 @@ struct SamModel {
 
     std::vector<Ort::Value> outputTensors;
 
-    outputTensorValuesPre = std::vector<float>(outputShapePre[0] * outputShapePre[1] *
-                                               outputShapePre[2] * outputShapePre[3]);
+    {
+      // Allocated on the node of the decoder threads, which read it much more often
+      ScopedAffinity decoderAffinity(cpus[1]);
+      output.owner.reset();
+      output.values.resize(outputShapePre[0] * outputShapePre[1] * outputShapePre[2] *
+                           outputShapePre[3]);
+      if (bSamHQ) {
+        output.intermValues.resize(intermShapePre[0] * intermShapePre[1] * intermShapePre[2] *
+                                   intermShapePre[3] * intermShapePre[4]);
+      }
+    }
     outputTensors.emplace_back(Ort::Value::CreateTensor<float>(
-        memoryInfo, outputTensorValuesPre.data(), outputTensorValuesPre.size(),
-        outputShapePre.data(), outputShapePre.size()));
+        memoryInfo, output.values.data(), output.values.size(), outputShapePre.data(),
+        outputShapePre.size()));
 
     if (bSamHQ) {
-      intermTensorValuesPre =
-          std::vector<float>(intermShapePre[0] * intermShapePre[1] * intermShapePre[2] *
-                             intermShapePre[3] * intermShapePre[4]);
       outputTensors.emplace_back(Ort::Value::CreateTensor<float>(
-          memoryInfo, intermTensorValuesPre.data(), intermTensorValuesPre.size(),
+          memoryInfo, output.intermValues.data(), output.intermValues.size(),
           intermShapePre.data(), intermShapePre.size()));
     }
 
-    Ort::RunOptions run_options;
+    auto run_options = runOptions(0);
     const char *inputNamesPre[] = {"input"}, *outputNamesPre[] = {"output", "interm_embeddings"};
     const char *inputNamesPreEdge[] = {"image"}, *outputNamesPreEdge[] = {"image_embeddings"};
     const auto inputNamesPre1 = bEdgeSam ? inputNamesPreEdge : inputNamesPre,
                outputNamesPre1 = bEdgeSam ? outputNamesPreEdge : outputNamesPre;
+    packing.stop();
+    auto encoder = timeStage(Sam::kEncoder);
     sessionPre->Run(run_options, inputNamesPre1, &inputTensor, 1, outputNamesPre1,
                     outputTensors.data(), outputTensors.size());
+    encoder.stop();
+    encodedImages++;
 
     return true;
   }
 
-  void getMask(const std::list<cv::Point>& points, const std::list<cv::Point>& negativePoints,
+  // Raw outputs of one decoder run, masks are the first mask channel of each prompt
+  struct DecoderResult {
+    std::vector<Ort::Value> outputs;
+    int maskIndex{0}, iouIndex{1}, lowResIndex{2}, batchSize{0};
+    cv::Size maskSize, imageSize;
+
+    // Low resolution logits of mask i, covering the longest side of the image (-1 if missing)
+    cv::Mat lowResMask(int i) {
+      if (lowResIndex < 0) {
+        return cv::Mat();
+      }
+      auto shape = outputs[lowResIndex].GetTensorTypeAndShapeInfo().GetShape();
+      return cv::Mat(shape[2], shape[3], CV_32FC1,
+                     outputs[lowResIndex].GetTensorMutableData<float>() +
+                         i * shape[1] * shape[2] * shape[3]);
+    }
+
+    float* mask(int i) {
+      auto shape = outputs[maskIndex].GetTensorTypeAndShapeInfo().GetShape();
+      return outputs[maskIndex].GetTensorMutableData<float>() + i * shape[1] * shape[2] * shape[3];
+    }
+    double iou(int i) {
+      auto& value = outputs[iouIndex];
+      auto count = value.GetTensorTypeAndShapeInfo().GetElementCount();
+      if (count == 0) {
+        return 0;
+      }
+      return value.GetTensorMutableData<float>()[i * (count / batchSize)];
+    }
+    // IoU of the mask binarized at +offset and at -offset, as the upstream stability score
+    double stability(int i, double offset) {
+      cv::Mat logits(maskSize, CV_32FC1, mask(i));
+      const int intersections = cv::countNonZero(logits > offset);
+      const int unions = cv::countNonZero(logits > -offset);
+      return unions > 0 ? double(intersections) / unions : 0;
+    }
+  };
+
+  // Run the decoder for batchSize prompts with numPoints points each, pointValues and labelValues
+  // are laid out as [batchSize, numPoints, 2] and [batchSize, numPoints], maskInput (if set)
+  // holds the batchSize low resolution masks of the prompts, the run is left out of the stats
+  // unless bRecord
+  bool runDecoder(const Embedding& embedding, std::vector<float>& pointValues,
+                  std::vector<float>& labelValues, int batchSize, DecoderResult& result,
+                  const float* maskInput = nullptr, bool bRecord = true) const {
+    if (batchSize <= 0 || labelValues.size() % batchSize != 0 ||
+        pointValues.size() != 2 * labelValues.size()) {
+      std::cerr << "Mismatch in input points or labels size.\n";
+      return false;
+    }
+
+    auto input = timeStage(Sam::kDecoderInput, bRecord);
+    const int64_t numPoints = labelValues.size() / batchSize;
+    std::vector<int64_t> inputPointShape = {batchSize, numPoints, 2},
+                         pointLabelsShape = {batchSize, numPoints},
+                         maskInputShape = {1, 1, 256, 256}, hasMaskInputShape = {1},
+                         origImSizeShape = {2};
+    float hasMaskValues[] = {maskInput != nullptr ? 1.f : 0.f},
+          origImSizeValues[] = {static_cast<float>(embedding.imageSize.height),
+                                static_cast<float>(embedding.imageSize.width)};
+
+    std::vector<Ort::Value> inputTensorsSam;
+    inputTensorsSam.emplace_back(Ort::Value::CreateTensor<float>(
+        memoryInfo, (float*)embedding.data(0), embedding.size(0),
+        outputShapePre.data(), outputShapePre.size()));
+
+    auto inputNames = inputNamesSam, outputNames = outputNamesSam;
+    int outputNumber = 3;
+    result.maskIndex = 0;
+    result.iouIndex = 1;
+    if (bSamHQ) {
+      inputTensorsSam.emplace_back(Ort::Value::CreateTensor<float>(
+          memoryInfo, (float*)embedding.data(1), embedding.size(1),
+          intermShapePre.data(), intermShapePre.size()));
+      inputNames = inputNamesSamHQ;
+    } else if (bEdgeSam) {
+      outputNames = outputNamesEdgeSam;
+      outputNumber = 2;
+      result.maskIndex = 1;
+      result.iouIndex = 0;
+    }
+    // The masks of EdgeSAM are low resolution ones
+    result.lowResIndex = bEdgeSam ? result.maskIndex : 2;
+
+    inputTensorsSam.emplace_back(
+        Ort::Value::CreateTensor<float>(memoryInfo, pointValues.data(), pointValues.size(),
+                                        inputPointShape.data(), inputPointShape.size()));
+    inputTensorsSam.emplace_back(
+        Ort::Value::CreateTensor<float>(memoryInfo, labelValues.data(), labelValues.size(),
+                                        pointLabelsShape.data(), pointLabelsShape.size()));
+
+    if (!bEdgeSam) {
+      if (maskInput != nullptr) {
+        maskInputShape[0] = batchSize;
+      }
+      inputTensorsSam.emplace_back(Ort::Value::CreateTensor<float>(
+          memoryInfo, const_cast<float*>(maskInput != nullptr ? maskInput : maskInputValues.data()),
+          maskInputValues.size() * maskInputShape[0], maskInputShape.data(),
+          maskInputShape.size()));
+      inputTensorsSam.emplace_back(Ort::Value::CreateTensor<float>(
+          memoryInfo, hasMaskValues, 1, hasMaskInputShape.data(), hasMaskInputShape.size()));
+      inputTensorsSam.emplace_back(Ort::Value::CreateTensor<float>(
+          memoryInfo, origImSizeValues, 2, origImSizeShape.data(), origImSizeShape.size()));
+    }
+
+    auto runOptionsSam = runOptions(1);
+    ScopedAffinity affinity(cpus[1]);
+    input.stop();
+    auto decoder = timeStage(Sam::kDecoder, bRecord);
+    result.outputs = sessionSam->Run(runOptionsSam, inputNames, inputTensorsSam.data(),
+                                     inputTensorsSam.size(), outputNames, outputNumber);
+    decoder.stop();
+    if (bRecord) {
+      decodedPrompts += batchSize;
+    }
+
+    size_t outputBytes = 0;
+    for (auto& output : result.outputs) {
+      outputBytes += output.GetTensorTypeAndShapeInfo().GetElementCount() * sizeof(float);
+    }
+    size_t maxBytes = decoderOutputBytes;
+    while (outputBytes > maxBytes &&
+           !decoderOutputBytes.compare_exchange_weak(maxBytes, outputBytes)) {
+    }
+
+    if (result.outputs.size() < 2 || !result.outputs[result.maskIndex].IsTensor() ||
+        !result.outputs[result.iouIndex].IsTensor()) {
+      std::cerr << "Output tensors are missing or not tensors.\n";
+      return false;
+    }
+
+    auto maskShape = result.outputs[result.maskIndex].GetTensorTypeAndShapeInfo().GetShape();
+    if (maskShape.size() != 4 || maskShape[0] != batchSize) {
+      std::cerr << "Unexpected mask output shape.\n";
+      return false;
+    }
+    if (result.lowResIndex >= int(result.outputs.size()) ||
+        !result.outputs[result.lowResIndex].IsTensor() ||
+        result.outputs[result.lowResIndex].GetTensorTypeAndShapeInfo().GetShape().size() != 4) {
+      result.lowResIndex = -1;
+    }
+    result.batchSize = batchSize;
+    result.maskSize = cv::Size(maskShape[3], maskShape[2]);
+    result.imageSize = embedding.imageSize;
+    return true;
+  }
+
+  // Writes into outputMaskSam in place if it is already a CV_8UC1 image of the input size
+  bool getMask(const std::list<cv::Point>& points, const std::list<cv::Point>& negativePoints,
                const cv::Rect& roi, cv::Mat& outputMaskSam, double& iouValue) const {
+    InteractiveScope interactive(*this);
+    DecoderRequest request;
+    {
+      std::lock_guard<std::recursive_mutex> lock(recursive_mutex);
+      if (embedding.empty()) {
+        std::cerr << "Image not loaded" << std::endl;
+        return false;
+      }
+      if (!makePrompt(points, negativePoints, roi, request)) {
+        return false;
+      }
+    }
+    request.mask = &outputMaskSam;
+
+    try {
+      const bool bOk = bDecoderBatch && maxBatchSize > 1 ? decodeQueued(request)
+                                                         : decodeRequests({&request});
+      if (!bOk) {
+        return false;
+      }
+      iouValue = request.iou;
+      return true;
+    } catch (const Ort::Exception& e) {
+      std::cerr << "____sam_cpp_lib error message!!!____ ONNX Runtime exception: " << e.what()
+                << std::endl;
+      throw;
+    } catch (const std::exception& e) {
+      std::cerr << "____sam_cpp_lib error message!!!____ Standard exception: " << e.what()
+                << std::endl;
+      throw;
+    } catch (...) {
+      std::cerr << "____sam_cpp_lib error message!!!____ Unknown exception" << std::endl;
+      throw;
+    }
+  }
+
+  // Outlines of the mask of a prompt traced on the low resolution logits (or the masks if the
+  // decoder has none), without thresholding a mask of input size
+  bool getContours(const std::list<cv::Point>& points, const std::list<cv::Point>& negativePoints,
+                   const cv::Rect& roi, std::vector<std::vector<cv::Point2f>>& contours,
+                   double epsilon, double& iouValue) const {
+    InteractiveScope interactive(*this);
     std::lock_guard<std::recursive_mutex> lock(recursive_mutex);
-    const size_t maskInputSize = 256 * 256;
-    float maskInputValues[maskInputSize] = {0}, hasMaskValues[] = {0},
-          orig_im_size_values[] = {static_cast<float>(inputShapePre[2]),
-                                   static_cast<float>(inputShapePre[3])};
-    memset(maskInputValues, 0, sizeof(maskInputValues));
-
-    const float imgWidth = static_cast<float>(inputShapePre[3]);
-    const float imgHeight = static_cast<float>(inputShapePre[2]);
-    std::vector<float> inputPointValues, inputLabelValues;
+    if (embedding.empty()) {
+      std::cerr << "Image not loaded" << std::endl;
+      return false;
+    }
+    DecoderRequest request;
+    DecoderResult result;
+    if (!makePrompt(points, negativePoints, roi, request) ||
+        !runDecoder(embedding, request.pointValues, request.labelValues, 1, result)) {
+      return false;
+    }
+    iouValue = result.iou(0);
+
+    auto threshold = timeStage(Sam::kThreshold);
+    cv::Mat logits = result.lowResMask(0);
+    if (logits.empty()) {
+      logits = cv::Mat(result.maskSize, CV_32FC1, result.mask(0));
+    }
+    // The low resolution masks cover the longest side of the image, padded on the bottom or on
+    // the right, the padding is cut off before tracing
+    const cv::Size size = result.imageSize;
+    const double scale = double(std::max(size.width, size.height)) /
+                         std::max(logits.cols, logits.rows);
+    const cv::Rect valid(0, 0, std::min(logits.cols, int(std::ceil(size.width / scale))),
+                         std::min(logits.rows, int(std::ceil(size.height / scale))));
+    contours = traceZeroLevel(logits(valid));
+
+    // Pixel centers of the logits to pixel centers of the image, within the pixel borders
+    for (auto& contour : contours) {
+      for (auto& p : contour) {
+        p.x = std::clamp(float((p.x + 0.5) * scale - 0.5), -0.5f, size.width - 0.5f);
+        p.y = std::clamp(float((p.y + 0.5) * scale - 0.5), -0.5f, size.height - 0.5f);
+      }
+      if (epsilon > 0) {
+        std::vector<cv::Point2f> simplified;
+        cv::approxPolyDP(contour, simplified, epsilon, true);
+        contour = std::move(simplified);
+      }
+    }
+    contours.erase(std::remove_if(contours.begin(), contours.end(),
+                                  [](const auto& contour) { return contour.size() < 3; }),
+                   contours.end());
+    return true;
+  }
+
+  // Box of the positive logits of a low resolution mask in image coordinates, empty if none
+  static cv::Rect lowResBox(const cv::Mat& logits, const cv::Size& imageSize) {
+    const double scale = double(std::max(imageSize.width, imageSize.height)) /
+                         std::max(logits.cols, logits.rows);
+    std::vector<cv::Point> positives;
+    cv::findNonZero(logits > 0, positives);
+    if (positives.empty()) {
+      return cv::Rect();
+    }
+    const cv::Rect box = cv::boundingRect(positives);
+    const cv::Rect imageBox(cv::Point(int(box.x * scale), int(box.y * scale)),
+                            cv::Point(int(std::ceil(box.br().x * scale)),
+                                      int(std::ceil(box.br().y * scale))));
+    return imageBox & cv::Rect(cv::Point(), imageSize);
+  }
+
+  // Keeps the low resolution logits and the box of prompt i of a decoder run in track, thresholds
+  // its mask if mask is set
+  void updateTrack(DecoderResult& result, int i, Track& track, cv::Mat* mask) const {
+    cv::Mat logits = result.lowResMask(i);
+    if (logits.empty()) {
+      logits = cv::Mat(result.maskSize, CV_32FC1, result.mask(i));
+    }
+    if (!bEdgeSam && logits.total() == maskInputValues.size()) {
+      track.lowRes.assign(logits.ptr<float>(), logits.ptr<float>() + logits.total());
+    }
+    track.info.box = lowResBox(logits, result.imageSize);
+    track.info.iou = result.iou(i);
+    track.info.frames++;
+    if (mask != nullptr) {
+      cv::Mat upscaled;
+      thresholdMask(result, i, *mask, upscaled);
+    }
+  }
+
+  int addTrack(const std::list<cv::Point>& points, const std::list<cv::Point>& negativePoints,
+               const cv::Rect& roi, cv::Mat* mask) {
+    InteractiveScope interactive(*this);
+    std::lock_guard<std::recursive_mutex> lock(recursive_mutex);
+    if (embedding.empty()) {
+      std::cerr << "Image not loaded" << std::endl;
+      return -1;
+    }
+    DecoderRequest request;
+    DecoderResult result;
+    if (!makePrompt(points, negativePoints, roi, request) ||
+        !runDecoder(embedding, request.pointValues, request.labelValues, 1, result)) {
+      return -1;
+    }
+    auto threshold = timeStage(Sam::kThreshold);
+    Track track;
+    track.info.id = nextTrackId++;
+    updateTrack(result, 0, track, mask);
+    if (track.info.box.empty()) {
+      std::cerr << "Empty mask, object not tracked" << std::endl;
+      return -1;
+    }
+    tracks.push_back(std::move(track));
+    return tracks.back().info.id;
+  }
 
+  // Decode all tracks on the loaded image, prompted by their previous box and low resolution
+  // mask, in runs of up to maxBatchSize tracks (one per run unless the decoder takes batches of
+  // mask inputs)
+  bool track(std::vector<Sam::Track>& result, std::vector<cv::Mat>* masks, double minIou) {
+    InteractiveScope interactive(*this);
+    std::lock_guard<std::recursive_mutex> lock(recursive_mutex);
+    result.clear();
+    if (masks) {
+      masks->clear();
+    }
+    if (embedding.empty()) {
+      std::cerr << "Image not loaded" << std::endl;
+      return false;
+    }
+
+    const int runSize = bDecoderBatch && (bEdgeSam || bMaskInputBatch) ? std::max(maxBatchSize, 1)
+                                                                        : 1;
+    // Committed once every run succeeded, a failed call leaves the tracks as they were
+    std::vector<Track> kept;
+    std::vector<Sam::Track> keptInfos;
+    std::vector<cv::Mat> keptMasks;
+    std::vector<float> pointValues, labelValues, maskValues;
+    for (size_t begin = 0; begin < tracks.size(); begin += runSize) {
+      const int count = std::min<int>(runSize, tracks.size() - begin);
+      pointValues.clear();
+      labelValues.clear();
+      maskValues.clear();
+      bool bMasks = !bEdgeSam;
+      for (int i = 0; i < count; i++) {
+        const auto& t = tracks[begin + i];
+        const cv::Rect& box = t.info.box;
+        pointValues.insert(pointValues.end(), {float(box.x), float(box.y), float(box.br().x),
+                                               float(box.br().y)});
+        labelValues.insert(labelValues.end(), {2, 3});
+        bMasks = bMasks && !t.lowRes.empty();
+        maskValues.insert(maskValues.end(), t.lowRes.begin(), t.lowRes.end());
+      }
+
+      DecoderResult decoded;
+      if (!runDecoder(embedding, pointValues, labelValues, count, decoded,
+                      bMasks ? maskValues.data() : nullptr)) {
+        return false;
+      }
+      auto threshold = timeStage(Sam::kThreshold);
+      for (int i = 0; i < count; i++) {
+        Track t = tracks[begin + i];
+        cv::Mat mask;
+        updateTrack(decoded, i, t, masks ? &mask : nullptr);
+        // Lost objects: the decoder no longer believes in the mask
+        if (t.info.iou < minIou || t.info.box.empty()) {
+          continue;
+        }
+        keptInfos.push_back(t.info);
+        if (masks) {
+          keptMasks.push_back(mask);
+        }
+        kept.push_back(std::move(t));
+      }
+    }
+    tracks = std::move(kept);
+    result = std::move(keptInfos);
+    if (masks) {
+      *masks = std::move(keptMasks);
+    }
+    return true;
+  }
+
+  bool removeTrack(int id) {
+    std::lock_guard<std::recursive_mutex> lock(recursive_mutex);
+    auto it = std::find_if(tracks.begin(), tracks.end(),
+                           [id](const Track& t) { return t.info.id == id; });
+    if (it == tracks.end()) {
+      return false;
+    }
+    tracks.erase(it);
+    return true;
+  }
+
+  // Point and label values of a getMask prompt
+  bool makePrompt(const std::list<cv::Point>& points, const std::list<cv::Point>& negativePoints,
+                  const cv::Rect& roi, DecoderRequest& request) const {
+    const float imgWidth = static_cast<float>(embedding.imageSize.width);
+    const float imgHeight = static_cast<float>(embedding.imageSize.height);
+    auto& inputPointValues = request.pointValues;
+    auto& inputLabelValues = request.labelValues;
     for (const auto& point : points) {
       if (point.x < 0 || point.x >= imgWidth || point.y < 0 || point.y >= imgHeight) {
         std::cerr << "Invalid point in positive points list: (" << point.x << ", " << point.y << ")\n";
-        return;
+        return false;
       }
     }
     for (const auto& point : negativePoints) {
       if (point.x < 0 || point.x >= imgWidth || point.y < 0 || point.y >= imgHeight) {
         std::cerr << "Invalid point in negative points list: (" << point.x << ", " << point.y << ")\n";
-        return;
+        return false;
       }
     }
     if (!roi.empty()) {
@@ -215,7 +1557,7 @@ struct SamModel {
           roi.br().y >= imgHeight) {
         std::cerr << "Invalid ROI: (" << roi.x << ", " << roi.y << ", " << roi.width << ", "
                   << roi.height << ")\n";
-        return;
+        return false;
       }
     }
 
@@ -247,117 +1589,417 @@ struct SamModel {
       }
     }
 
-    const int numPoints = inputLabelValues.size();
-    std::vector<int64_t> inputPointShape = {1, numPoints, 2}, pointLabelsShape = {1, numPoints},
-                         maskInputShape = {1, 1, 256, 256}, hasMaskInputShape = {1},
-                         origImSizeShape = {2};
-
-    std::vector<Ort::Value> inputTensorsSam;
-    try {
-      inputTensorsSam.emplace_back(Ort::Value::CreateTensor<float>(
-          memoryInfo, (float*)outputTensorValuesPre.data(), outputTensorValuesPre.size(),
-          outputShapePre.data(), outputShapePre.size()));
+    return true;
+  }
 
-      auto inputNames = inputNamesSam, outputNames = outputNamesSam;
-      int outputNumber = 3, outputMaskIndex = 0, outputIOUIndex = 1;
-      if (bSamHQ) {
-        inputTensorsSam.emplace_back(Ort::Value::CreateTensor<float>(
-            memoryInfo, (float*)intermTensorValuesPre.data(), intermTensorValuesPre.size(),
-            intermShapePre.data(), intermShapePre.size()));
-        inputNames = inputNamesSamHQ;
-      } else if (bEdgeSam) {
-        outputNames = outputNamesEdgeSam;
-        outputNumber = 2;
-        outputMaskIndex = 1;
-        outputIOUIndex = 0;
-      }
-
-      if (inputPointValues.size() != 2 * numPoints || inputLabelValues.size() != numPoints) {
-        std::cerr << "Mismatch in input points or labels size.\n";
-        return;
+  // Decode request in a run shared with concurrent requests: the first waiting caller leads the
+  // next run, it waits up to batchWindow for more requests and decodes its own request with the
+  // oldest queued ones with the same number of points (up to maxBatchSize), the others wait for
+  // their result or their turn to lead
+  bool decodeQueued(DecoderRequest& request) const {
+    std::unique_lock<std::mutex> lock(batchMutex);
+    request.queued = std::chrono::steady_clock::now();
+    batchQueue.push_back(&request);
+    batchCondition.notify_all();
+
+    while (!request.bDone) {
+      if (bBatchRunning) {
+        batchCondition.wait(lock);
+        continue;
+      }
+      bBatchRunning = true;
+      if (batchWindow.count() > 0) {
+        batchCondition.wait_until(lock, batchQueue.front()->queued + batchWindow,
+                                  [&] { return int(batchQueue.size()) >= maxBatchSize; });
       }
 
+      std::vector<DecoderRequest*> batch;
+      const size_t numPoints = request.labelValues.size();
+      const auto now = std::chrono::steady_clock::now();
+      batchQueue.erase(std::find(batchQueue.begin(), batchQueue.end(), &request));
+      stageCounters[Sam::kDecoderQueue].add(
+          std::chrono::duration_cast<std::chrono::nanoseconds>(now - request.queued).count());
+      batch.push_back(&request);
+      for (auto it = batchQueue.begin();
+           it != batchQueue.end() && int(batch.size()) < maxBatchSize;) {
+        if ((*it)->labelValues.size() == numPoints) {
+          stageCounters[Sam::kDecoderQueue].add(
+              std::chrono::duration_cast<std::chrono::nanoseconds>(now - (*it)->queued).count());
+          batch.push_back(*it);
+          it = batchQueue.erase(it);
+        } else {
+          ++it;
+        }
+      }
 
-      inputTensorsSam.emplace_back(
-          Ort::Value::CreateTensor<float>(memoryInfo, inputPointValues.data(), 2 * numPoints,
-                                          inputPointShape.data(), inputPointShape.size()));
-      inputTensorsSam.emplace_back(
-          Ort::Value::CreateTensor<float>(memoryInfo, inputLabelValues.data(),
-                                                                numPoints, pointLabelsShape.data(),
-                                                                pointLabelsShape.size()));
+      lock.unlock();
+      std::exception_ptr exception;
+      try {
+        decodeRequests(batch);
+      } catch (...) {
+        exception = std::current_exception();
+      }
+      lock.lock();
+      for (auto* r : batch) {
+        r->bDone = true;
+        if (exception) {
+          r->bOk = false;
+          r->exception = exception;
+        }
+      }
+      bBatchRunning = false;
+      batchCondition.notify_all();
+    }
+    if (request.exception) {
+      std::rethrow_exception(request.exception);
+    }
+    return request.bOk;
+  }
 
-      if (!bEdgeSam) {
-        inputTensorsSam.emplace_back(
-            Ort::Value::CreateTensor<float>(memoryInfo, maskInputValues, maskInputSize,
-                                            maskInputShape.data(), maskInputShape.size()));
-        inputTensorsSam.emplace_back(Ort::Value::CreateTensor<float>(
-            memoryInfo, hasMaskValues, 1, hasMaskInputShape.data(), hasMaskInputShape.size()));
-        inputTensorsSam.emplace_back(Ort::Value::CreateTensor<float>(
-            memoryInfo, orig_im_size_values, 2, origImSizeShape.data(), origImSizeShape.size()));
+  // Decode requests with the same number of points in one run
+  bool decodeRequests(const std::vector<DecoderRequest*>& requests) const {
+    std::lock_guard<std::recursive_mutex> lock(recursive_mutex);
+    const int batchSize = requests.size();
+    if (batchSize == 0 || embedding.empty()) {
+      return false;
+    }
+    std::vector<float> batchPointValues, batchLabelValues;
+    if (batchSize > 1) {
+      for (auto* request : requests) {
+        batchPointValues.insert(batchPointValues.end(), request->pointValues.begin(),
+                                request->pointValues.end());
+        batchLabelValues.insert(batchLabelValues.end(), request->labelValues.begin(),
+                                request->labelValues.end());
       }
+    }
+    auto& pointValues = batchSize > 1 ? batchPointValues : requests[0]->pointValues;
+    auto& labelValues = batchSize > 1 ? batchLabelValues : requests[0]->labelValues;
+
+    DecoderResult result;
+    if (!runDecoder(embedding, pointValues, labelValues, batchSize, result)) {
+      return false;
+    }
+    batchSizes[std::min(batchSize, Sam::Stats::kBatchSizeBuckets) - 1]++;
+
+    auto threshold = timeStage(Sam::kThreshold);
+    cv::Mat upscaled;
+    for (int i = 0; i < batchSize; i++) {
+      thresholdMask(result, i, *requests[i]->mask, upscaled);
+      requests[i]->iou = result.iou(i);
+      requests[i]->bOk = true;
+    }
+    return true;
+  }
 
-      if (outputMaskSam.type() != CV_8UC1 ||
-          outputMaskSam.size() != cv::Size(inputShapePre[3], inputShapePre[2])) {
-        outputMaskSam = cv::Mat(inputShapePre[2], inputShapePre[3], CV_8UC1);
+  Sam::MemoryUsage getMemoryUsage() const {
+    std::lock_guard<std::recursive_mutex> lock(recursive_mutex);
+    Sam::MemoryUsage usage;
+    usage.weights = weightsBytes;
+    usage.embeddings =
+        (embedding.values.capacity() + embedding.intermValues.capacity()) * sizeof(float);
+    usage.decoderScratch = maskInputValues.size() * sizeof(float) + decoderOutputBytes;
+#if ORT_API_VERSION >= 23
+    // Allocator statistics are only available since ONNX Runtime 1.23
+    if (isLoaded(modelLoaded, false)) {
+      usage.arenas = 0;
+      for (auto session : {sessionSam.get(), sessionPre.get()}) {
+        if (session == nullptr) {
+          break;
+        }
+        Ort::Allocator allocator(*session, memoryInfo);
+        auto stats = allocator.GetStats();
+        if (auto value = stats.GetValue("TotalAllocated")) {
+          usage.arenas += std::stoll(value);
+        }
+        if (bSharedArena) {
+          break;
+        }
       }
+    }
+#endif
+    return usage;
+  }
+
+  void shrinkArenas() {
+    shrinkPending[0] = shrinkPending[1] = true;
+    decoderOutputBytes = 0;
 
-      Ort::RunOptions runOptionsSam;
-      auto outputTensorsSam = sessionSam->Run(runOptionsSam, inputNames, inputTensorsSam.data(),
-                                              inputTensorsSam.size(), outputNames, outputNumber);
+    std::lock_guard<std::recursive_mutex> lock(recursive_mutex);
+    if (!embedding.empty()) {
+      // A single point run applies the request to the decoder right away, left out of the stats
+      std::vector<float> pointValues = {embedding.imageSize.width / 2.f,
+                                        embedding.imageSize.height / 2.f},
+                         labelValues = {1};
+      DecoderResult result;
+      runDecoder(embedding, pointValues, labelValues, 1, result, nullptr, false);
+    }
+  }
 
-      if (outputTensorsSam.size() < 2 || !outputTensorsSam[outputMaskIndex].IsTensor() || !outputTensorsSam[outputIOUIndex].IsTensor()) {
-        std::cerr << "Output tensors are missing or not tensors.\n";
+  // Binarize all masks of a decoder run into one CV_8UC1 image of batchSize stacked masks, each
+  // of input size (rows [i * height, (i + 1) * height) belong to prompt i)
+  void thresholdMasks(DecoderResult& result, cv::Mat& batchMask) const {
+    const cv::Size size = result.imageSize;
+    batchMask.create(size.height * result.batchSize, size.width, CV_8UC1);
+
+    if (result.maskSize == size) {
+      const auto shape = result.outputs[result.maskIndex].GetTensorTypeAndShapeInfo().GetShape();
+      if (shape[1] == 1) {
+        // Masks are contiguous, threshold the whole batch in a single pass
+        cv::Mat logits(size.height * result.batchSize, size.width, CV_32FC1, result.mask(0));
+        cv::compare(logits, 0, batchMask, cv::CMP_GT);
         return;
       }
+    }
 
+    cv::Mat upscaled;
+    for (int i = 0; i < result.batchSize; i++) {
+      cv::Mat dst = batchMask.rowRange(i * size.height, (i + 1) * size.height);
+      thresholdMask(result, i, dst, upscaled);
+    }
+  }
+
+  // Binarize mask i of a decoder run into mask, in place if it is already a CV_8UC1 image of input
+  // size (upscaled holds the upscaled logits of low resolution masks)
+  void thresholdMask(DecoderResult& result, int i, cv::Mat& mask, cv::Mat& upscaled) const {
+    mask.create(result.imageSize, CV_8UC1);
+    cv::Mat logits(result.maskSize, CV_32FC1, result.mask(i));
+    if (logits.size() != result.imageSize) {
+      cv::resize(logits, upscaled, result.imageSize);
+      logits = upscaled;
+    }
+    cv::compare(logits, 0, mask, cv::CMP_GT);
+  }
 
-      auto& outputMask = outputTensorsSam[outputMaskIndex];
-      auto maskShape = outputMask.GetTensorTypeAndShapeInfo().GetShape();
+  static bool isVersion(const Embedding& embedding, uint64_t version) {
+    if (embedding.version != version) {
+      std::cerr << "Image replaced while decoding" << std::endl;
+      return false;
+    }
+    return true;
+  }
 
-      cv::Mat outputMaskImage(maskShape[2], maskShape[3], CV_32FC1,
-                              outputMask.GetTensorMutableData<float>());
-      if (outputMaskImage.size() != outputMaskSam.size()) {
-        cv::resize(outputMaskImage, outputMaskImage, outputMaskSam.size());
+  // Decode one single-point prompt per batch item, at most maxBatchSize prompts per run (decoders
+  // exported with a fixed batch size of 1 are run one prompt at a time), background work yielding
+  // to the pending interactive calls before each run, false once cancel is set or if embedding is
+  // no longer version (another image loaded meanwhile)
+  bool getMasks(const Embedding& embedding, uint64_t version, const std::vector<cv::Point>& points,
+                int maxBatchSize, cv::Mat& batchMask, std::vector<double>& ious,
+                std::vector<double>* stabilities = nullptr, double stabilityOffset = 1.0,
+                Sam::Priority priority = Sam::kBackground,
+                const std::atomic<bool>* cancel = nullptr) const {
+    const int batchSize = points.size();
+    cv::Size imageSize;
+    {
+      std::lock_guard<std::recursive_mutex> lock(recursive_mutex);
+      if (batchSize == 0 || embedding.empty() || !isVersion(embedding, version)) {
+        return false;
       }
+      imageSize = embedding.imageSize;
+    }
+    if (!bDecoderBatch || maxBatchSize <= 1) {
+      maxBatchSize = 1;
+    }
 
-      for (int i = 0; i < outputMaskSam.rows; i++) {
-        for (int j = 0; j < outputMaskSam.cols; j++) {
-          outputMaskSam.at<uint8_t>(i, j) = outputMaskImage.at<float>(i, j) > 0 ? 255 : 0;
-        }
+    const int height = imageSize.height;
+    batchMask.create(height * batchSize, imageSize.width, CV_8UC1);
+    ious.resize(batchSize);
+    if (stabilities) {
+      stabilities->resize(batchSize);
+    }
+
+    std::vector<float> inputPointValues, inputLabelValues;
+    for (int begin = 0; begin < batchSize; begin += maxBatchSize) {
+      const int count = std::min(maxBatchSize, batchSize - begin);
+      inputPointValues.clear();
+      inputLabelValues.assign(count, 1);
+      for (int i = begin; i < begin + count; i++) {
+        inputPointValues.emplace_back(static_cast<float>(points[i].x));
+        inputPointValues.emplace_back(static_cast<float>(points[i].y));
       }
 
-      if (outputTensorsSam.size() > 1 &&
-          outputTensorsSam[1].GetTensorTypeAndShapeInfo().GetElementCount() > 0) {
-        iouValue = outputTensorsSam[outputIOUIndex].GetTensorMutableData<float>()[0];
-      } else {
-        std::cerr << "____sam_cpp_lib error message!!!____ IOU tensor is missing or empty"
-                  << std::endl;
-        iouValue = 0.0;  // default value in case of error
+      if (priority == Sam::kBackground) {
+        yieldToInteractive();
+      }
+      if (cancel != nullptr && cancel->load()) {
+        return false;
+      }
+      std::lock_guard<std::recursive_mutex> lock(recursive_mutex);
+      DecoderResult result;
+      if (!isVersion(embedding, version) ||
+          !runDecoder(embedding, inputPointValues, inputLabelValues, count, result)) {
+        return false;
+      }
+
+      // The chunk is thresholded in place, create() keeps the row range since it already matches
+      auto threshold = timeStage(Sam::kThreshold);
+      cv::Mat dst = batchMask.rowRange(begin * height, (begin + count) * height);
+      thresholdMasks(result, dst);
+      for (int i = 0; i < count; i++) {
+        ious[begin + i] = result.iou(i);
+        if (stabilities) {
+          (*stabilities)[begin + i] = result.stability(i, stabilityOffset);
+        }
       }
-    } catch (const Ort::Exception& e) {
-      std::cerr << "____sam_cpp_lib error message!!!____ ONNX Runtime exception: " << e.what()
-                << std::endl;
-      throw;
-    } catch (const std::exception& e) {
-      std::cerr << "____sam_cpp_lib error message!!!____ Standard exception: " << e.what()
-                << std::endl;
-      throw;
-    } catch (...) {
-      std::cerr << "____sam_cpp_lib error message!!!____ Unknown exception" << std::endl;
-      throw;
     }
+    return true;
   }
 };
 
 Sam::Sam(const std::string& preModelPath, const std::string& samModelPath, int threadsNumber)
     : Sam(Parameter(preModelPath, samModelPath, threadsNumber)) {}
 
-Sam::Sam(const Parameter& param) : m_model(new SamModel(param)) {}
+Sam::Sam(const Parameter& param) : Sam(param, nullptr) {}
+
+Sam::Sam(const Parameter& param, const SharedModel& sharedModel) : Sam(param, sharedModel, true) {}
+
+Sam::Sam(const Parameter& param, const SharedModel& sharedModel, bool bWait)
+    : m_model(new SamModel(param, sharedModel)) {
+  if (bWait) {
+    try {
+      m_model->modelLoaded.get();
+    } catch (...) {
+      delete m_model;
+      throw;
+    }
+  }
+}
+
+std::unique_ptr<Sam> Sam::createAsync(const Parameter& param, const SharedModel& sharedModel) {
+  return std::unique_ptr<Sam>(new Sam(param, sharedModel, false));
+}
+
+std::shared_future<bool> Sam::decoderReady() const { return m_model->decoderLoaded; }
+std::shared_future<bool> Sam::ready() const { return m_model->modelLoaded; }
+
+Sam::SharedModel Sam::createSharedModel() { return std::make_shared<SamSharedModel>(); }
 
 Sam::~Sam() { delete m_model; }
 
 cv::Size Sam::getInputSize() const { return m_model->getInputSize(); }
 bool Sam::loadImage(const cv::Mat& image) { return m_model->loadImage(image); }
+bool Sam::loadImage(const ImageView& image) { return m_model->loadImage(image); }
+
+bool Sam::getEmbedding(std::vector<float>& values, std::vector<float>& intermValues,
+                       cv::Size& imageSize) const {
+  std::lock_guard<std::recursive_mutex> lock(m_model->recursive_mutex);
+  const auto& embedding = m_model->embedding;
+  if (embedding.empty()) {
+    std::cerr << "Image not loaded" << std::endl;
+    return false;
+  }
+  values.assign(embedding.data(0), embedding.data(0) + embedding.size(0));
+  intermValues.assign(embedding.data(1), embedding.data(1) + embedding.size(1));
+  imageSize = embedding.imageSize;
+  return true;
+}
+
+bool Sam::readEmbedding(const cbEmbedding& read) const {
+  std::lock_guard<std::recursive_mutex> lock(m_model->recursive_mutex);
+  const auto& embedding = m_model->embedding;
+  if (embedding.empty()) {
+    std::cerr << "Image not loaded" << std::endl;
+    return false;
+  }
+  return read(embedding.data(0), embedding.size(0), embedding.data(1), embedding.size(1),
+              embedding.imageSize);
+}
+
+bool Sam::setEmbedding(const std::vector<float>& values, const std::vector<float>& intermValues,
+                       const cv::Size& imageSize) {
+  return m_model->setEmbedding(values, intermValues, imageSize);
+}
+
+bool Sam::setEmbedding(const float* values, size_t numValues, const float* intermValues,
+                       size_t numIntermValues, const cv::Size& imageSize,
+                       const std::shared_ptr<const void>& owner) {
+  return m_model->setEmbedding(values, numValues, intermValues, numIntermValues, imageSize,
+                               owner);
+}
+
+Sam::MemoryUsage Sam::getMemoryUsage() const { return m_model->getMemoryUsage(); }
+void Sam::shrinkArenas() { m_model->shrinkArenas(); }
+
+Sam::Stats Sam::getStats() const {
+  Stats stats;
+  for (int i = 0; i < kNumStages; i++) {
+    const auto& counter = m_model->stageCounters[i];
+    auto& stage = stats.stages[i];
+    stage.count = counter.count;
+    stage.totalMs = counter.totalNs / 1e6;
+    stage.maxMs = counter.maxNs / 1e6;
+    for (int j = 0; j < StageStats::kBuckets; j++) {
+      stage.histogram[j] = counter.histogram[j];
+    }
+  }
+  stats.encodedImages = m_model->encodedImages;
+  stats.decodedPrompts = m_model->decodedPrompts;
+  for (int i = 0; i < Stats::kBatchSizeBuckets; i++) {
+    stats.batchSizes[i] = m_model->batchSizes[i];
+  }
+  return stats;
+}
+
+void Sam::resetStats() {
+  for (auto& counter : m_model->stageCounters) {
+    counter.reset();
+  }
+  m_model->encodedImages = 0;
+  m_model->decodedPrompts = 0;
+  for (auto& count : m_model->batchSizes) {
+    count = 0;
+  }
+}
+
+double Sam::StageStats::percentileMs(double p) const {
+  const double rank = p / 100 * count;
+  int64_t runs = 0;
+  for (int i = 0; i < kBuckets - 1; i++) {
+    runs += histogram[i];
+    if (runs > 0 && runs >= rank) {
+      return std::min(maxMs, (int64_t(1) << i) / 1000.);
+    }
+  }
+  return maxMs;
+}
+
+bool Sam::getContours(const std::list<cv::Point>& points,
+                      const std::list<cv::Point>& negativePoints, const cv::Rect& roi,
+                      std::vector<std::vector<cv::Point2f>>& contours, double epsilon,
+                      double* iou) const {
+  double iouValue = 0;
+  if (!m_model->getContours(points, negativePoints, roi, contours, epsilon, iouValue)) {
+    return false;
+  }
+  if (iou != nullptr) {
+    *iou = iouValue;
+  }
+  return true;
+}
+
+int Sam::addTrack(const std::list<cv::Point>& points, const std::list<cv::Point>& negativePoints,
+                  const cv::Rect& roi, cv::Mat* mask) {
+  return m_model->addTrack(points, negativePoints, roi, mask);
+}
+
+bool Sam::track(std::vector<Track>& tracks, std::vector<cv::Mat>* masks, double minIou) {
+  return m_model->track(tracks, masks, minIou);
+}
+
+bool Sam::removeTrack(int id) { return m_model->removeTrack(id); }
+
+void Sam::clearTracks() {
+  std::lock_guard<std::recursive_mutex> lock(m_model->recursive_mutex);
+  m_model->tracks.clear();
+}
+
+std::vector<Sam::Track> Sam::getTracks() const {
+  std::lock_guard<std::recursive_mutex> lock(m_model->recursive_mutex);
+  std::vector<Track> tracks;
+  for (const auto& t : m_model->tracks) {
+    tracks.push_back(t.info);
+  }
+  return tracks;
+}
 
 cv::Mat Sam::getMask(const cv::Point& point, double* iou) const {
   return getMask({point}, {}, {}, iou);
@@ -370,88 +2012,578 @@ cv::Mat Sam::getMask(const std::list<cv::Point>& points, const std::list<cv::Poi
 
 cv::Mat Sam::getMask(const std::list<cv::Point>& points, const std::list<cv::Point>& negativePoints,
                      const cv::Rect& roi, double* iou) const {
+  cv::Mat m = cv::Mat::zeros(m_model->getImageSize(), CV_8UC1);
+  getMask(points, negativePoints, roi, m, iou);
+  return m;
+}
+
+bool Sam::getMask(const std::list<cv::Point>& points, const std::list<cv::Point>& negativePoints,
+                  const cv::Rect& roi, cv::Mat& mask, double* iou) const {
   double iouValue = 0;
-  cv::Mat m;
-  m = cv::Mat::zeros(m_model->getInputSize().height, m_model->getInputSize().width, CV_8UC1);
-  m_model->getMask(points, negativePoints, roi, m, iouValue);
+  if (!m_model->getMask(points, negativePoints, roi, mask, iouValue)) {
+    return false;
+  }
   if (iou != nullptr) {
     *iou = iouValue;
   }
-  return m;
+  return true;
 }
 
-// Just a poor version of
-// https://github.com/facebookresearch/segment-anything/blob/main/notebooks/automatic_mask_generator_example.ipynb
 cv::Mat Sam::autoSegment(const cv::Size& numPoints, cbProgress cb, const double iouThreshold,
                          const double minArea, int* numObjects) const {
-  if (numPoints.empty()) {
-    return {};
+  AutoSegmentParameter param(numPoints);
+  param.iouThreshold = iouThreshold;
+  param.minArea = minArea;
+  return autoSegment(param, cb, numObjects);
+}
+
+namespace {
+
+// Bit-packed copy of a mask at 1 / kScale resolution, used to compare candidates of autoSegment
+// without touching their full resolution masks
+struct CompactMask {
+  static constexpr int kScale = 4;
+  cv::Rect box;  // bounding box in compact coordinates
+  int area{0}, wordsPerRow{0};
+  std::vector<uint64_t> bits;
+
+  // mask covers rect of an image of the given size
+  CompactMask(const cv::Mat& mask, const cv::Rect& rect, const cv::Size& size) {
+    cv::Mat small = cv::Mat::zeros((size.height + kScale - 1) / kScale,
+                                   (size.width + kScale - 1) / kScale, CV_8UC1);
+    const cv::Rect smallRect =
+        cv::Rect(cv::Point(rect.x / kScale, rect.y / kScale),
+                 cv::Point(std::max(rect.x / kScale + 1, (rect.br().x + kScale - 1) / kScale),
+                           std::max(rect.y / kScale + 1, (rect.br().y + kScale - 1) / kScale))) &
+        cv::Rect(0, 0, small.cols, small.rows);
+    cv::Mat resized;
+    cv::resize(mask, resized, smallRect.size(), 0, 0, cv::INTER_AREA);
+    resized.copyTo(small(smallRect));
+
+    wordsPerRow = (small.cols + 63) / 64;
+    bits.assign(wordsPerRow * small.rows, 0);
+
+    int minX = small.cols, minY = small.rows, maxX = -1, maxY = -1;
+    for (int i = smallRect.y; i < smallRect.br().y; i++) {
+      const auto src = small.ptr<uchar>(i);
+      auto dst = bits.data() + i * wordsPerRow;
+      for (int j = smallRect.x; j < smallRect.br().x; j++) {
+        if (src[j] < 128) {
+          continue;
+        }
+        dst[j / 64] |= uint64_t(1) << (j % 64);
+        area++;
+        minX = std::min(minX, j);
+        maxX = std::max(maxX, j);
+        minY = std::min(minY, i);
+        maxY = std::max(maxY, i);
+      }
+    }
+    if (area > 0) {
+      box = cv::Rect(cv::Point(minX, minY), cv::Point(maxX + 1, maxY + 1));
+    }
   }
 
-  const auto size = getInputSize();
-  cv::Mat mask, outImage = cv::Mat::zeros(size, CV_64FC1);
+  // Returns true if the mask IoU may exceed threshold, the overlap of the boxes bounds the
+  // intersection and the larger mask bounds the union
+  bool mayOverlap(const CompactMask& other, double threshold) const {
+    const auto overlap = box & other.box;
+    return !overlap.empty() && overlap.area() > threshold * std::max(area, other.area);
+  }
+
+  double iou(const CompactMask& other) const {
+    const auto overlap = box & other.box;
+    if (overlap.empty()) {
+      return 0;
+    }
 
-  std::vector<double> masksAreas;
+    int intersections = 0;
+    const int firstWord = overlap.x / 64, lastWord = (overlap.br().x - 1) / 64;
+    for (int i = overlap.y; i < overlap.br().y; i++) {
+      const auto a = bits.data() + i * wordsPerRow, b = other.bits.data() + i * wordsPerRow;
+      for (int w = firstWord; w <= lastWord; w++) {
+        intersections += std::bitset<64>(a[w] & b[w]).count();
+      }
+    }
+    return double(intersections) / (area + other.area - intersections);
+  }
 
-  for (int i = 0; i < numPoints.height; i++) {
-    for (int j = 0; j < numPoints.width; j++) {
-      if (cb) {
-        cb(double(i * numPoints.width + j) / (numPoints.width * numPoints.height));
+  // Set the pixels of the mask in coverage (of the compact size)
+  void paint(cv::Mat& coverage) const {
+    for (int i = box.y; i < box.br().y; i++) {
+      const auto src = bits.data() + i * wordsPerRow;
+      auto dst = coverage.ptr<uchar>(i);
+      for (int j = box.x; j < box.br().x; j++) {
+        if (src[j / 64] & (uint64_t(1) << (j % 64))) {
+          dst[j] = 255;
+        }
       }
+    }
+  }
+};
 
-      cv::Point input(cv::Point((j + 0.5) * size.width / numPoints.width,
-                                (i + 0.5) * size.height / numPoints.height));
+// Mask that passed the filters of autoSegment, cropped to its bounding box in image coordinates
+struct Candidate {
+  CompactMask compact;
+  cv::Mat mask;
+  cv::Rect box;
+  double iou, stability;
+  int cropArea;
+  cv::Point point;
+
+  // Masks from smaller crops win as upstream does, then the higher predicted IoU
+  bool betterThan(const Candidate& other) const {
+    return cropArea != other.cropArea ? cropArea < other.cropArea : iou > other.iou;
+  }
+};
 
-      double iou;
-      m_model->getMask({input}, {}, {}, mask, iou);
-      if (mask.empty() || iou < iouThreshold) {
-        continue;
+// Mask-level NMS run as candidates arrive: a candidate overlapping a better one (or any one if
+// bKeepFirst) is not added, the worse ones it overlaps are removed
+bool addCandidate(std::vector<Candidate>& candidates, Candidate& candidate, double threshold,
+                  bool bKeepFirst) {
+  std::vector<size_t> suppressed;
+  for (size_t c = 0; c < candidates.size(); c++) {
+    auto& other = candidates[c];
+    if (!candidate.compact.mayOverlap(other.compact, threshold) ||
+        candidate.compact.iou(other.compact) <= threshold) {
+      continue;
+    }
+    if (bKeepFirst || !candidate.betterThan(other)) {
+      return false;
+    }
+    suppressed.push_back(c);
+  }
+  for (auto it = suppressed.rbegin(); it != suppressed.rend(); ++it) {
+    candidates.erase(candidates.begin() + *it);
+  }
+  candidates.push_back(std::move(candidate));
+  return true;
+}
+
+// Same as generate_crop_boxes of upstream: the whole image, then 2^i x 2^i overlapping crops
+// for each layer i
+void generateCropBoxes(const cv::Size& size, int numLayers, double overlapRatio,
+                       std::vector<cv::Rect>& boxes, std::vector<int>& layers) {
+  boxes = {cv::Rect({0, 0}, size)};
+  layers = {0};
+  const int shortSide = std::min(size.width, size.height);
+  for (int layer = 1; layer <= numLayers; layer++) {
+    const int numCrops = 1 << layer;
+    const int overlap = overlapRatio * shortSide * 2 / numCrops;
+    const int cropWidth = (overlap * (numCrops - 1) + size.width + numCrops - 1) / numCrops;
+    const int cropHeight = (overlap * (numCrops - 1) + size.height + numCrops - 1) / numCrops;
+    for (int i = 0; i < numCrops; i++) {
+      for (int j = 0; j < numCrops; j++) {
+        const cv::Point tl((cropWidth - overlap) * j, (cropHeight - overlap) * i);
+        boxes.push_back(cv::Rect(tl, cv::Point(std::min(tl.x + cropWidth, size.width),
+                                               std::min(tl.y + cropHeight, size.height))));
+        layers.push_back(layer);
       }
+    }
+  }
+}
+
+// Masks cut by the border of a crop (but not by the border of the image) are incomplete
+bool isNearCropEdge(const cv::Rect& box, const cv::Rect& crop, const cv::Size& size) {
+  const int tolerance = 20;
+  auto near = [](int a, int b) { return std::abs(a - b) <= tolerance; };
+  return (near(box.x, crop.x) && !near(box.x, 0)) || (near(box.y, crop.y) && !near(box.y, 0)) ||
+         (near(box.br().x, crop.br().x) && !near(box.br().x, size.width)) ||
+         (near(box.br().y, crop.br().y) && !near(box.br().y, size.height));
+}
 
-      std::vector<std::vector<cv::Point>> contours;
-      cv::findContours(mask, contours, cv::RETR_EXTERNAL, cv::CHAIN_APPROX_SIMPLE);
-      if (contours.empty()) {
+// Paint the pixels of contourMask (covering maskBox) inside boundingBox with index, unless they
+// already belong to a smaller object
+template <typename T>
+void paintObject(cv::Mat& labels, const cv::Mat& contourMask, const cv::Rect& maskBox,
+                 const cv::Rect& boundingBox, int index, std::vector<double>& masksAreas,
+                 std::vector<Sam::AutoSegmentObject>& objects) {
+  const double area = masksAreas[index - 1];
+  auto& object = objects[index - 1];
+  for (int i = boundingBox.y; i < boundingBox.y + boundingBox.height; i++) {
+    const auto src = contourMask.ptr<uchar>(i - maskBox.y);
+    auto dst = labels.ptr<T>(i);
+    for (int j = boundingBox.x; j < boundingBox.x + boundingBox.width; j++) {
+      if (src[j - maskBox.x] == 0) {
         continue;
       }
 
-      int maxContourIndex = 0;
-      double maxContourArea = 0;
-      for (int i = 0; i < contours.size(); i++) {
-        double area = cv::contourArea(contours[i]);
-        if (area > maxContourArea) {
-          maxContourArea = area;
-          maxContourIndex = i;
+      const auto label = (int)dst[j];
+      if (label > 0) {
+        if (masksAreas[label - 1] < area) {
+          continue;
         }
+        objects[label - 1].area--;
       }
-      if (maxContourArea < minArea) {
-        continue;
+      dst[j] = static_cast<T>(index);
+      object.area++;
+    }
+  }
+}
+
+}  // namespace
+
+cv::Mat Sam::autoSegment(const AutoSegmentParameter& param, cbProgress cb, int* numObjects,
+                         std::vector<AutoSegmentObject>* objects, int* numDecoderRuns) const {
+  return autoSegment(cv::Mat(), param, cb, numObjects, objects, numDecoderRuns);
+}
+
+// Just a poor version of
+// https://github.com/facebookresearch/segment-anything/blob/main/notebooks/automatic_mask_generator_example.ipynb
+cv::Mat Sam::autoSegment(const cv::Mat& image, const AutoSegmentParameter& param, cbProgress cb,
+                         int* numObjects, std::vector<AutoSegmentObject>* objects,
+                         int* numDecoderRuns) const {
+  std::vector<AutoSegmentObject> segmentedObjects;
+  auto outImage = autoSegment(image, param, cbObject(), cb ? cbProgressContext(cb) : nullptr,
+                              nullptr, &segmentedObjects, numDecoderRuns);
+  if (numObjects != nullptr) {
+    *numObjects = segmentedObjects.size();
+  }
+  if (objects != nullptr) {
+    *objects = std::move(segmentedObjects);
+  }
+  return outImage;
+}
+
+cv::Mat Sam::autoSegment(const cv::Mat& image, const AutoSegmentParameter& param,
+                         const cbObject& onObject, const cbProgressContext& onProgress,
+                         const std::atomic<bool>* cancel, std::vector<AutoSegmentObject>* objects,
+                         int* numDecoderRuns) const {
+  const auto& numPoints = param.numPoints;
+  if (numPoints.empty()) {
+    return {};
+  }
+  if (param.labelType != CV_64FC1 && param.labelType != CV_32SC1 &&
+      param.labelType != CV_16UC1) {
+    std::cerr << "Unsupported label type" << std::endl;
+    return {};
+  }
+
+  // Masks of the loaded embedding are of its image size, those of the crops of the input size
+  uint64_t version = 0;
+  const auto size = m_model->getImageSize(&version), inputSize = getInputSize();
+  if (size.empty()) {
+    std::cerr << "Image not loaded" << std::endl;
+    return {};
+  }
+  std::vector<cv::Rect> crops;
+  std::vector<int> layers;
+  generateCropBoxes(size, std::max(0, param.cropLayers), param.cropOverlapRatio, crops, layers);
+  if (crops.size() > 1 && image.size() != size) {
+    std::cerr << "Crop layers require the loaded image" << std::endl;
+    return {};
+  }
+
+  std::vector<cv::Size> grids;
+  int totalPoints = 0, donePoints = 0;
+  for (auto layer : layers) {
+    int factor = 1;
+    for (int i = 0; i < layer; i++) {
+      factor *= std::max(1, param.cropPointsDownscale);
+    }
+    grids.emplace_back(std::max(1, numPoints.width / factor),
+                       std::max(1, numPoints.height / factor));
+    totalPoints += grids.back().area();
+  }
+
+  // The whole image is already encoded, each following crop is encoded in the background while
+  // the previous one is decoded
+  SamModel::Embedding embeddings[2];
+  auto encodeCrop = [&](size_t k) {
+    return std::async(std::launch::async, [&, k] {
+      cv::Mat cropImage;
+      cv::resize(image(crops[k]), cropImage, inputSize);
+      return m_model->encode(cropImage, embeddings[k % 2]);
+    });
+  };
+  std::future<bool> encoding;
+  if (crops.size() > 1) {
+    encoding = encodeCrop(1);
+  }
+
+  cv::Mat batchMask, outImage = cv::Mat::zeros(size, param.labelType);
+  std::vector<Candidate> candidates;
+  std::vector<double> masksAreas, ious, stabilities;
+  const bool bStability = param.stabilityThreshold > 0;
+  const int pointsPerBatch = std::max(1, param.pointsPerBatch);
+  const int maxDecoderRuns = param.maxDecoderRuns > 0 ? param.maxDecoderRuns : INT_MAX;
+  // Points decoded per decoder run, getMasks decodes one point per run without a batch axis
+  const int runPoints = m_model->bDecoderBatch ? pointsPerBatch : 1;
+  int decoderRuns = 0;
+  bool bCancelled = false;
+  auto isCancelled = [&]() {
+    bCancelled = bCancelled || (cancel != nullptr && cancel->load());
+    return bCancelled;
+  };
+
+  // Paint the largest contour of a candidate into the label image, objectMask is set to the
+  // filled contour cropped to the box of the object
+  std::vector<AutoSegmentObject> segmentedObjects;
+  const int maxLabel = param.labelType == CV_16UC1 ? 65535 : INT_MAX;
+  auto composite = [&](const Candidate& candidate, cv::Mat& objectMask) {
+    auto timer = m_model->timeStage(kComposite);
+    if ((int)masksAreas.size() >= maxLabel) {
+      std::cerr << "Too many objects for the label type" << std::endl;
+      return false;
+    }
+
+    std::vector<std::vector<cv::Point>> contours;
+    cv::findContours(candidate.mask, contours, cv::RETR_EXTERNAL, cv::CHAIN_APPROX_SIMPLE,
+                     candidate.box.tl());
+    if (contours.empty()) {
+      return false;
+    }
+
+    int maxContourIndex = 0;
+    double maxContourArea = 0;
+    for (int i = 0; i < contours.size(); i++) {
+      double area = cv::contourArea(contours[i]);
+      if (area > maxContourArea) {
+        maxContourArea = area;
+        maxContourIndex = i;
+      }
+    }
+    if (maxContourArea < param.minArea) {
+      return false;
+    }
+
+    cv::Mat contourMask = cv::Mat::zeros(candidate.box.size(), CV_8UC1);
+    cv::drawContours(contourMask, contours, maxContourIndex, cv::Scalar(255), cv::FILLED,
+                     cv::LINE_8, cv::noArray(), INT_MAX, -candidate.box.tl());
+    cv::Rect boundingBox = cv::boundingRect(contours[maxContourIndex]);
+
+    const int index = masksAreas.size() + 1;
+    masksAreas.emplace_back(maxContourArea);
+    segmentedObjects.push_back(
+        {index, 0, boundingBox, candidate.iou, candidate.stability, candidate.point});
+
+    switch (param.labelType) {
+      case CV_64FC1:
+        paintObject<double>(outImage, contourMask, candidate.box, boundingBox, index, masksAreas,
+                            segmentedObjects);
+        break;
+      case CV_32SC1:
+        paintObject<int>(outImage, contourMask, candidate.box, boundingBox, index, masksAreas,
+                         segmentedObjects);
+        break;
+      default:
+        paintObject<uint16_t>(outImage, contourMask, candidate.box, boundingBox, index,
+                              masksAreas, segmentedObjects);
+    }
+
+    if (segmentedObjects.back().area == 0) {
+      masksAreas.pop_back();
+      segmentedObjects.pop_back();
+      return false;
+    }
+    objectMask = contourMask(boundingBox - candidate.box.tl());
+    return true;
+  };
+
+  // Image areas covered by accepted masks at the resolution of CompactMask
+  cv::Mat coverage = cv::Mat::zeros((size.height + CompactMask::kScale - 1) / CompactMask::kScale,
+                                    (size.width + CompactMask::kScale - 1) / CompactMask::kScale,
+                                    CV_8UC1);
+
+  bool bFailed = false;
+  for (size_t k = 0; k < crops.size(); k++) {
+    const SamModel::Embedding* embedding = &m_model->embedding;
+    if (k > 0) {
+      if (!encoding.get()) {
+        std::cerr << "Encoding of crop " << crops[k] << " failed" << std::endl;
+        bFailed = true;
+        break;
       }
+      if (isCancelled()) {
+        bFailed = true;
+        break;
+      }
+      embedding = &embeddings[k % 2];
+      if (k + 1 < crops.size()) {
+        encoding = encodeCrop(k + 1);
+      }
+    }
+
+    const auto& crop = crops[k];
+    // Adaptive sampling starts from a grid 2^adaptiveLevels times coarser, so that its last level
+    // is as fine as grids[k]
+    cv::Size grid = grids[k];
+    if (param.adaptiveSampling) {
+      const int levels = std::min(std::max(0, param.adaptiveLevels), 16);
+      grid = cv::Size(std::max(1, grid.width >> levels), std::max(1, grid.height >> levels));
+    }
+    const cv::Size maskSize = k > 0 ? embedding->imageSize : size;
+    const double scaleX = double(crop.width) / maskSize.width,
+                 scaleY = double(crop.height) / maskSize.height;
+    const auto cropCompact = cv::Rect(crop.tl() / CompactMask::kScale,
+                                      (crop.br() + cv::Point(CompactMask::kScale - 1,
+                                                             CompactMask::kScale - 1)) /
+                                          CompactMask::kScale) &
+                             cv::Rect({0, 0}, coverage.size());
+    auto isCovered = [&](const cv::Point& p) {
+      const cv::Point q(int((crop.x + p.x * scaleX) / CompactMask::kScale),
+                        int((crop.y + p.y * scaleY) / CompactMask::kScale));
+      return coverage.at<uchar>(std::min(q.y, coverage.rows - 1),
+                                std::min(q.x, coverage.cols - 1)) > 0;
+    };
+
+    // Cell centers of the current sampling level, in coordinates of the (resized) crop
+    cv::Size2d cell(double(maskSize.width) / grid.width, double(maskSize.height) / grid.height);
+    std::vector<cv::Point2d> centers;
+    for (int i = 0; i < grid.height; i++) {
+      for (int j = 0; j < grid.width; j++) {
+        centers.emplace_back((j + 0.5) * cell.width, (i + 0.5) * cell.height);
+      }
+    }
+
+    for (int level = 0;; level++) {
+      // The centers covered by the masks of the previous batches are skipped
+      for (size_t next = 0; next < centers.size();) {
+        std::vector<cv::Point> batch;
+        const int maxCount = int(std::min<int64_t>(
+            pointsPerBatch, int64_t(maxDecoderRuns - decoderRuns) * runPoints));
+        for (; next < centers.size() && int(batch.size()) < maxCount; next++) {
+          const cv::Point input(int(centers[next].x), int(centers[next].y));
+          if (!param.adaptiveSampling || !isCovered(input)) {
+            batch.push_back(input);
+          }
+        }
+        if (batch.empty()) {
+          break;
+        }
+        const int count = batch.size();
+        if (isCancelled()) {
+          bFailed = true;
+          break;
+        }
+        if (onProgress) {
+          onProgress(std::min(1., double(donePoints) / totalPoints));
+        }
 
-      cv::Mat contourMask = cv::Mat::zeros(size, CV_8UC1);
-      cv::drawContours(contourMask, contours, maxContourIndex, cv::Scalar(255), cv::FILLED);
-      cv::Rect boundingBox = cv::boundingRect(contours[maxContourIndex]);
+        if (!m_model->getMasks(*embedding, k > 0 ? embedding->version : version, batch,
+                               pointsPerBatch, batchMask, ious, bStability ? &stabilities : nullptr,
+                               param.stabilityOffset, param.priority, cancel)) {
+          isCancelled();
+          bFailed = true;
+          break;
+        }
+        decoderRuns += (count + runPoints - 1) / runPoints;
+        donePoints += count;
+
+        // Best masks first, so that they are kept when streaming (first one wins in NMS)
+        std::vector<int> order(count);
+        std::iota(order.begin(), order.end(), 0);
+        std::stable_sort(order.begin(), order.end(),
+                         [&](int a, int b) { return ious[a] > ious[b]; });
+
+        for (int i : order) {
+          if (ious[i] < param.iouThreshold ||
+              (bStability && stabilities[i] < param.stabilityThreshold)) {
+            continue;
+          }
+          cv::Mat mask = batchMask.rowRange(i * maskSize.height, (i + 1) * maskSize.height);
+          const auto cropBox = cv::boundingRect(mask);
+          if (cropBox.empty()) {
+            continue;
+          }
 
-      int index = masksAreas.size() + 1, numPixels = 0;
-      for (int i = boundingBox.y; i < boundingBox.y + boundingBox.height; i++) {
-        for (int j = boundingBox.x; j < boundingBox.x + boundingBox.width; j++) {
-          if (contourMask.at<uchar>(i, j) == 0) {
+          // Map the box from the (resized) crop to the image
+          const cv::Rect box =
+              cv::Rect(
+                  cv::Point(crop.x + int(cropBox.x * scaleX), crop.y + int(cropBox.y * scaleY)),
+                  cv::Point(crop.x + int(std::ceil(cropBox.br().x * scaleX)),
+                            crop.y + int(std::ceil(cropBox.br().y * scaleY)))) &
+              crop;
+          if (box.empty() || (layers[k] > 0 && isNearCropEdge(box, crop, size))) {
             continue;
           }
 
-          auto dst = (int)outImage.at<double>(i, j);
-          if (dst > 0 && masksAreas[dst - 1] < maxContourArea) {
+          const cv::Point point(crop.x + int(batch[i].x * scaleX),
+                                crop.y + int(batch[i].y * scaleY));
+          Candidate candidate{CompactMask(mask(cropBox), box, size),
+                              {},
+                              box,
+                              ious[i],
+                              bStability ? stabilities[i] : 0,
+                              crop.area(),
+                              point};
+          if (candidate.compact.area == 0 ||
+              !addCandidate(candidates, candidate, param.nmsThreshold, bool(onObject))) {
             continue;
           }
-          outImage.at<double>(i, j) = index;
-          numPixels++;
+          auto& added = candidates.back();
+          added.compact.paint(coverage);
+          if (box.size() == cropBox.size()) {
+            added.mask = mask(cropBox).clone();
+          } else {
+            cv::resize(mask(cropBox), added.mask, box.size(), 0, 0, cv::INTER_NEAREST);
+          }
+
+          cv::Mat objectMask;
+          if (onObject && composite(added, objectMask)) {
+            onObject(segmentedObjects.back(), objectMask);
+          }
         }
       }
-      if (numPixels == 0) {
-        continue;
+
+      if (bFailed || !param.adaptiveSampling || level >= param.adaptiveLevels ||
+          decoderRuns >= maxDecoderRuns ||
+          cv::countNonZero(coverage(cropCompact)) >= param.coverageTarget * cropCompact.area()) {
+        break;
+      }
+
+      // Split the cells whose center is still uncovered (no mask or a rejected one) into 2 x 2
+      // cells, the children already covered being skipped when decoding
+      cell = cv::Size2d(cell.width / 2, cell.height / 2);
+      std::vector<cv::Point2d> children;
+      for (const auto& center : centers) {
+        if (isCovered(cv::Point(int(center.x), int(center.y)))) {
+          continue;
+        }
+        for (int dy = -1; dy <= 1; dy += 2) {
+          for (int dx = -1; dx <= 1; dx += 2) {
+            children.emplace_back(center.x + dx * cell.width / 2, center.y + dy * cell.height / 2);
+          }
+        }
       }
+      if (children.empty()) {
+        break;
+      }
+      centers.swap(children);
+    }
+    if (bFailed || decoderRuns >= maxDecoderRuns) {
+      break;
+    }
+  }
 
-      masksAreas.emplace_back(maxContourArea);
+  if (bCancelled) {
+    return {};
+  }
+  if (bFailed) {
+    std::cerr << "Automatic segmentation failed" << std::endl;
+    return {};
+  }
+  if (!onObject) {
+    cv::Mat objectMask;
+    for (const auto& candidate : candidates) {
+      composite(candidate, objectMask);
     }
   }
+
+  // Objects entirely painted over by later ones have no pixel left in the label image
+  segmentedObjects.erase(std::remove_if(segmentedObjects.begin(), segmentedObjects.end(),
+                                        [](const AutoSegmentObject& object) {
+                                          return object.area == 0;
+                                        }),
+                         segmentedObjects.end());
+  if (objects != nullptr) {
+    *objects = std::move(segmentedObjects);
+  }
+  if (numDecoderRuns != nullptr) {
+    *numDecoderRuns = decoderRuns;
+  }
+  if (onProgress) {
+    onProgress(1.);
+  }
   return outImage;
 }
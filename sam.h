@@ -1,11 +1,17 @@
 #ifndef SAMCPP__SAM_H_
 #define SAMCPP__SAM_H_
 
+#include <atomic>
+#include <functional>
+#include <future>
 #include <opencv2/core.hpp>
 #include <string>
 #include <list>
+#include <memory>
+#include <vector>
 
 struct SamModel;
+struct SamSharedModel;
 
 #if _MSC_VER
 class __declspec(dllexport) Sam {
@@ -23,8 +29,54 @@ class Sam {
       size_t gpuMemoryLimit{0};
     };
     Provider providers[2];  // 0 - embedding, 1 - segmentation
-    std::string models[2];  // 0 - embedding, 1 - segmentation
+    // 0 - embedding, 1 - segmentation (without models[0] and modelBuffers[0], the instance only
+    // decodes the embeddings passed to setEmbedding, e.g. published by another process)
+    std::string models[2];
+    // Models in memory used instead of the files of models if data is set (only read while
+    // loading), the external data files they refer to are looked for in externalDataDir
+    struct ModelBuffer {
+      const void* data{nullptr};
+      size_t size{0};
+      std::string externalDataDir;
+    };
+    ModelBuffer modelBuffers[2];  // 0 - embedding, 1 - segmentation
+    // Parse the model files from a read-only mapping instead of reading them (weights stored as
+    // external data are mapped by ONNX Runtime, sharing their pages between processes)
+    bool mapModels{false};
+    // CPUs the threads of each session run on (Linux only, e.g. "0-7,16-23", empty for any), the
+    // embedding and the decoder memory are allocated on the NUMA node of the segmentation CPUs
+    std::string cpuSets[2];  // 0 - embedding, 1 - segmentation
     int threadsNumber{1};
+    // Run all sessions of the process on global thread pools of threadsNumber threads instead of
+    // threadsNumber threads per session (set by the first instance, the runtime environment
+    // being process-wide)
+    bool globalThreadPool{false};
+    // Directory of the optimized models, written on first load and loaded directly afterwards
+    // (skipping most of the graph optimization, only the CPU-specific layout optimizations are
+    // applied on each load so that machines of any CPU type can share it), empty to disable
+    std::string cacheDir;
+    // Load the decoder before the preprocessing model instead of both in parallel, so that it is
+    // ready as soon as possible for embeddings restored with setEmbedding
+    bool decoderFirst{false};
+    // Concurrent getMask calls on an instance are decoded together, up to maxBatchSize prompts
+    // with the same number of points per decoder run (decoders exported with a dynamic batch axis
+    // only, 1 disables). The first waiting call waits up to batchWindowUs microseconds for others,
+    // calls arriving during a run being decoded together in the next one anyway.
+    int maxBatchSize{16};
+    int batchWindowUs{0};
+    // Decoder runs of background work (autoSegment by default) wait for the pending getMask calls
+    // of the instance, up to backgroundYieldMs per run, so that a getMask call waits for at most
+    // one background run (of up to pointsPerBatch points)
+    int backgroundYieldMs{1000};
+    // Memory options of the ONNX Runtime sessions
+    struct Memory {
+      // Pool the CPU allocations (faster, but the pool keeps its peak size until shrinkArenas)
+      bool cpuArena{true};
+      // Growth of the CPU and CUDA arenas: 0 - next power of two, 1 - only the requested size
+      int arenaExtendStrategy{0};
+      // Preallocate the intermediate buffers planned from the shapes of the previous run
+      bool memoryPattern{true};
+    } memory;
     Parameter(const std::string& preModelPath, const std::string& samModelPath, int threadsNumber) {
       models[0] = preModelPath;
       models[1] = samModelPath;
@@ -36,21 +88,216 @@ class Sam {
   Sam(const std::string& preModelPath, const std::string& samModelPath, int threadsNumber);
   // Recommended constructor
   Sam(const Parameter& param);
+  // Instances created from the same shared model share the runtime environment, the CPU arena,
+  // the prepacked weights and, if their models and options are the same, the sessions, each one
+  // keeping its own embedding
+  using SharedModel = std::shared_ptr<SamSharedModel>;
+  static SharedModel createSharedModel();
+  Sam(const Parameter& param, const SharedModel& sharedModel);
+  // Returns at once while the models load in the background, the calls needing a model wait for
+  // it and getInputSize is empty until the preprocessing model is loaded
+  static std::unique_ptr<Sam> createAsync(const Parameter& param,
+                                          const SharedModel& sharedModel = nullptr);
+  // Ready once the decoder, or both models, are loaded with the loading result (an exception
+  // thrown while loading is rethrown by get)
+  std::shared_future<bool> decoderReady() const;
+  std::shared_future<bool> ready() const;
   ~Sam();
 
   cv::Size getInputSize() const;
+  // 8-bit BGR, BGRA or grayscale image of the input size, possibly a ROI of a larger image
   bool loadImage(const cv::Mat& image);
 
+  // Formats of the 8-bit pixels of an ImageView
+  enum PixelFormat { kBGR, kRGB, kBGRA, kRGBA, kGray };
+  // Image in a caller buffer, read in place (the pixels are converted while packing the encoder
+  // input): size.height rows of step bytes, of which roi is encoded (the whole image if empty)
+  struct ImageView {
+    const void* data{nullptr};
+    cv::Size size;
+    size_t step{0};
+    PixelFormat format{kBGR};
+    cv::Rect roi;  // must have the input size
+  };
+  bool loadImage(const ImageView& image);
+  // Embedding of the loaded image (intermValues for HQ-SAM only), to restore it later without the
+  // preprocessing model, imageSize being the size of the image passed to loadImage
+  bool getEmbedding(std::vector<float>& values, std::vector<float>& intermValues,
+                    cv::Size& imageSize) const;
+  // Passes the embedding of the loaded image to read while it can't be replaced, e.g. to copy it
+  // straight to its destination, false if no image is loaded or read fails
+  using cbEmbedding =
+      std::function<bool(const float* values, size_t numValues, const float* intermValues,
+                         size_t numIntermValues, const cv::Size& imageSize)>;
+  bool readEmbedding(const cbEmbedding& read) const;
+  bool setEmbedding(const std::vector<float>& values, const std::vector<float>& intermValues,
+                    const cv::Size& imageSize);
+  // Decodes the embedding in place, in memory kept alive by owner (e.g. a shared memory mapping)
+  // until another embedding is set
+  bool setEmbedding(const float* values, size_t numValues, const float* intermValues,
+                    size_t numIntermValues, const cv::Size& imageSize,
+                    const std::shared_ptr<const void>& owner);
+
   cv::Mat getMask(const std::list<cv::Point>& points, const std::list<cv::Point>& negativePoints,
                   const cv::Rect& roi, double* iou = nullptr) const;
   cv::Mat getMask(const std::list<cv::Point>& points, const std::list<cv::Point>& negativePoints,
                   double* iou = nullptr) const;
   cv::Mat getMask(const cv::Point& point, double* iou = nullptr) const;
+  // Writes the mask into mask, in place if it is already a CV_8UC1 image of the input size (e.g.
+  // a view of a caller buffer), false if the prompt or the image is invalid
+  bool getMask(const std::list<cv::Point>& points, const std::list<cv::Point>& negativePoints,
+               const cv::Rect& roi, cv::Mat& mask, double* iou = nullptr) const;
+  // Outlines of the mask of a prompt, traced at sub-pixel precision on the low resolution logits
+  // of the decoder without computing the mask, in image coordinates (pixel centers) and
+  // simplified to epsilon pixels if epsilon > 0. Outer boundaries are clockwise on screen and
+  // holes counterclockwise.
+  bool getContours(const std::list<cv::Point>& points, const std::list<cv::Point>& negativePoints,
+                   const cv::Rect& roi, std::vector<std::vector<cv::Point2f>>& contours,
+                   double epsilon = 0, double* iou = nullptr) const;
+
+  // Video object tracking: objects added on a frame are followed on the next frames (loaded with
+  // loadImage or setEmbedding), each one prompted by its box and its low resolution mask on the
+  // previous frame
+  struct Track {
+    int id{0};
+    cv::Rect box;   // on the last frame
+    double iou{0};  // predicted IoU on the last frame
+    int frames{0};  // frames the object was found on
+  };
+  // Id of the track of the object of a prompt on the loaded frame, -1 on failure (mask, if set,
+  // receives its mask)
+  int addTrack(const std::list<cv::Point>& points, const std::list<cv::Point>& negativePoints,
+               const cv::Rect& roi, cv::Mat* mask = nullptr);
+  // Follows all tracks on the loaded frame, in batched decoder runs if the decoder has dynamic
+  // batch axes on point_coords and mask_input (one run per track otherwise). Tracks whose
+  // predicted IoU falls below minIou (or whose mask vanishes) are dropped, tracks receives the
+  // others and masks (if set) their masks, in the same order. A failed call leaves the tracks
+  // unchanged.
+  bool track(std::vector<Track>& tracks, std::vector<cv::Mat>* masks = nullptr,
+             double minIou = 0.5);
+  bool removeTrack(int id);
+  void clearTracks();
+  std::vector<Track> getTracks() const;
+
+  // Bytes held by this instance
+  struct MemoryUsage {
+    size_t weights{0};         // model files (shared by the instances of a shared model)
+    size_t embeddings{0};      // embedding of the loaded image
+    size_t decoderScratch{0};  // decoder constant inputs and largest decoder outputs so far
+    int64_t arenas{-1};        // reserved by the CPU arena, -1 if the runtime can't report it
+  };
+  MemoryUsage getMemoryUsage() const;
+  // Release the unused memory of the arenas: at once for the decoder if an image is loaded,
+  // at the end of the next run otherwise
+  void shrinkArenas();
+
+  // Stages timed by getStats
+  enum Stage {
+    kInputPacking,     // image to encoder input tensor
+    kEncoder,          // preprocessing model run
+    kDecoderInput,     // decoder input tensors
+    kDecoder,          // sam model run
+    kThreshold,        // upsampling, thresholding and stability scores of the masks
+    kComposite,        // contours and painting of the objects of autoSegment
+    kDecoderQueue,     // wait of a getMask prompt for its batched decoder run
+    kBackgroundYield,  // wait of background decoder runs for pending getMask calls
+    kNumStages
+  };
+  struct StageStats {
+    static constexpr int kBuckets = 24;
+    int64_t count{0};
+    double totalMs{0}, maxMs{0};
+    // histogram[i] counts the runs that took [2^(i-1), 2^i) microseconds (less than 1 us for
+    // i = 0, the last bucket has no upper bound)
+    int64_t histogram[kBuckets]{};
+    double meanMs() const { return count > 0 ? totalMs / count : 0; }
+    // Upper bound of the histogram bucket holding the p-th percentile (p in [0, 100])
+    double percentileMs(double p) const;
+  };
+  struct Stats {
+    static constexpr int kBatchSizeBuckets = 32;
+    StageStats stages[kNumStages];
+    int64_t encodedImages{0}, decodedPrompts{0};
+    // batchSizes[i] counts the getMask decoder runs of i + 1 prompts (the last bucket counting
+    // the larger ones too)
+    int64_t batchSizes[kBatchSizeBuckets]{};
+  };
+  // Counters since construction or the last resetStats, always on and safe to read while other
+  // calls are running
+  Stats getStats() const;
+  void resetStats();
+
+  // Priority classes of decoder runs: getMask calls are interactive, background runs wait for
+  // the pending interactive calls of the instance between two runs
+  enum Priority { kInteractive, kBackground };
+
+  struct AutoSegmentParameter {
+    cv::Size numPoints;  // number of grid points on each side
+    double iouThreshold{0.86}, minArea{100};
+    // Masks whose stability score (IoU of the masks binarized at +/- stabilityOffset around the
+    // mask threshold) is below stabilityThreshold are dropped, 0 disables the check
+    double stabilityThreshold{0.95}, stabilityOffset{1.0};
+    // Masks overlapping a mask with higher predicted IoU by more than this are dropped (1 disables)
+    double nmsThreshold{0.7};
+    // Grid points decoded per decoder run, only used if the decoder is exported with a dynamic
+    // batch axis (otherwise one point per run)
+    int pointsPerBatch{64};
+    // Crop layers as crop_n_layers of upstream: layer i splits the image into 2^i x 2^i crops
+    // overlapping by cropOverlapRatio, each encoded separately with a grid of numPoints divided
+    // by cropPointsDownscale^i (requires the image passed to autoSegment)
+    int cropLayers{0}, cropPointsDownscale{1};
+    double cropOverlapRatio{512 / 1500.};
+    // Type of the returned label image: CV_64FC1, CV_32SC1 or CV_16UC1 (up to 65535 objects)
+    int labelType{CV_64FC1};
+    // Adaptive sampling starts from a grid of numPoints / 2^adaptiveLevels points, skips the
+    // points already covered by the masks of the previous batches and splits the cells left
+    // uncovered into 2 x 2 cells for up to adaptiveLevels levels, until coverageTarget of the crop
+    // is covered
+    bool adaptiveSampling{false};
+    int adaptiveLevels{2};
+    double coverageTarget{0.95};
+    // Maximum number of decoder runs over all crops and levels (a run decodes up to
+    // pointsPerBatch points with a batch axis, one otherwise), 0 for no limit
+    int maxDecoderRuns{0};
+    // kInteractive to run as getMask calls (e.g. a preview the user is waiting for)
+    Priority priority{kBackground};
+    AutoSegmentParameter(const cv::Size& numPoints) : numPoints(numPoints) {}
+  };
+
+  // Object of the label image returned by autoSegment
+  struct AutoSegmentObject {
+    int label{0};
+    int area{0};   // number of pixels with this label
+    cv::Rect box;  // bounding box of the object mask (before overlapping objects are painted)
+    double iou{0}, stability{0};
+    cv::Point point;  // grid point the mask was decoded from
+  };
 
   using cbProgress = void (*)(double);
+  using cbProgressContext = std::function<void(double)>;
+  // Receives an object of autoSegment and its filled mask covering object.box
+  using cbObject = std::function<void(const AutoSegmentObject&, const cv::Mat&)>;
   cv::Mat autoSegment(const cv::Size& numPoints, cbProgress cb = {},
                       const double iouThreshold = 0.86, const double minArea = 100,
                       int* numObjects = nullptr) const;
+  cv::Mat autoSegment(const AutoSegmentParameter& param, cbProgress cb = {},
+                      int* numObjects = nullptr, std::vector<AutoSegmentObject>* objects = nullptr,
+                      int* numDecoderRuns = nullptr) const;
+  // image must be the image passed to loadImage, only used by crop layers
+  cv::Mat autoSegment(const cv::Mat& image, const AutoSegmentParameter& param, cbProgress cb = {},
+                      int* numObjects = nullptr, std::vector<AutoSegmentObject>* objects = nullptr,
+                      int* numDecoderRuns = nullptr) const;
+  // Streaming version, each object is passed to onObject as soon as it is final (NMS then keeps
+  // the first of overlapping masks, decoded best first, instead of the best one overall), cancel
+  // is checked between decoder runs and an empty image is returned once it is set
+  cv::Mat autoSegment(const cv::Mat& image, const AutoSegmentParameter& param,
+                      const cbObject& onObject, const cbProgressContext& onProgress = {},
+                      const std::atomic<bool>* cancel = nullptr,
+                      std::vector<AutoSegmentObject>* objects = nullptr,
+                      int* numDecoderRuns = nullptr) const;
+
+ private:
+  Sam(const Parameter& param, const SharedModel& sharedModel, bool bWait);
 };
 
 #endif  // SAMCPP__SAM_H_
@@ -0,0 +1,317 @@
+#include "sam_client.h"
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+
+#include "sam_protocol.h"
+
+using namespace sam_protocol;
+
+SamClient::SamClient(const std::string& socketPath) {
+  sockaddr_un address{};
+  address.sun_family = AF_UNIX;
+  if (socketPath.size() >= sizeof(address.sun_path)) {
+    std::cerr << "Socket path too long: " << socketPath << std::endl;
+    return;
+  }
+  std::strncpy(address.sun_path, socketPath.c_str(), sizeof(address.sun_path) - 1);
+  m_socket = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (m_socket < 0 ||
+      connect(m_socket, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+    std::cerr << "Unable to connect to " << socketPath << ": " << std::strerror(errno)
+              << std::endl;
+    disconnect();
+    return;
+  }
+
+  // The first message carries the descriptor of the shared memory of the connection
+  Response hello;
+  iovec iov{&hello, sizeof(hello)};
+  char control[CMSG_SPACE(sizeof(int))] = {};
+  msghdr msg{};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  if (recvmsg(m_socket, &msg, MSG_WAITALL) != ssize_t(sizeof(hello)) || hello.magic != kMagic) {
+    std::cerr << "Invalid answer of sam_server" << std::endl;
+    disconnect();
+    return;
+  }
+  cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  if (cmsg != nullptr && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+    std::memcpy(&m_sharedFd, CMSG_DATA(cmsg), sizeof(int));
+  }
+  void* p = m_sharedFd < 0 ? MAP_FAILED
+                           : mmap(nullptr, hello.bufferSize, PROT_READ, MAP_SHARED, m_sharedFd, 0);
+  if (p == MAP_FAILED) {
+    std::cerr << "Unable to map the shared memory of sam_server" << std::endl;
+    disconnect();
+    return;
+  }
+  m_shared = static_cast<const uint8_t*>(p);
+  m_sharedSize = hello.bufferSize;
+  m_inputSize = cv::Size(hello.cols, hello.rows);
+}
+
+SamClient::SamClient(const std::shared_ptr<SamServer>& server)
+    : m_server(server), m_inputSize(server->getInputSize()) {}
+
+SamClient::~SamClient() {
+  for (auto handle : m_handles) {
+    m_server->release(handle);
+  }
+  disconnect();
+}
+
+void SamClient::disconnect() {
+  if (m_shared != nullptr) {
+    munmap(const_cast<uint8_t*>(m_shared), m_sharedSize);
+    m_shared = nullptr;
+    m_sharedSize = 0;
+  }
+  if (m_sharedFd >= 0) {
+    close(m_sharedFd);
+    m_sharedFd = -1;
+  }
+  if (m_socket >= 0) {
+    close(m_socket);
+    m_socket = -1;
+  }
+}
+
+bool SamClient::isConnected() const { return m_server || m_socket >= 0; }
+
+cv::Size SamClient::getInputSize() const { return isConnected() ? m_inputSize : cv::Size(); }
+
+bool SamClient::call(uint32_t type, Handle handle, std::initializer_list<Part> payload,
+                     Response& response, std::vector<char>* reply) {
+  if (m_socket < 0) {
+    std::cerr << "Not connected to sam_server" << std::endl;
+    return false;
+  }
+  Header header;
+  header.type = type;
+  header.handle = handle;
+  for (const auto& part : payload) {
+    header.size += part.second;
+  }
+  bool bOk = writeAll(m_socket, &header, sizeof(header));
+  for (const auto& part : payload) {
+    bOk = bOk && writeAll(m_socket, part.first, part.second);
+  }
+  bOk = bOk && readAll(m_socket, &response, sizeof(response)) && response.magic == kMagic &&
+        response.size <= kMaxPayload;
+  std::vector<char> discarded;
+  if (bOk) {
+    auto& data = reply != nullptr ? *reply : discarded;
+    data.resize(response.size);
+    bOk = readAll(m_socket, data.data(), data.size());
+  }
+  if (!bOk) {
+    std::cerr << "Connection to sam_server lost" << std::endl;
+    disconnect();
+    return false;
+  }
+
+  // The server grew the shared memory
+  if (response.bufferSize != m_sharedSize) {
+    munmap(const_cast<uint8_t*>(m_shared), m_sharedSize);
+    void* p = mmap(nullptr, response.bufferSize, PROT_READ, MAP_SHARED, m_sharedFd, 0);
+    if (p == MAP_FAILED) {
+      std::cerr << "Unable to map the shared memory of sam_server" << std::endl;
+      m_shared = nullptr;
+      disconnect();
+      return false;
+    }
+    m_shared = static_cast<const uint8_t*>(p);
+    m_sharedSize = response.bufferSize;
+  }
+  return response.status == 0;
+}
+
+SamClient::Handle SamClient::loadImage(const cv::Mat& image) {
+  if (m_server) {
+    const Handle handle = m_server->loadImage(image);
+    if (handle != 0) m_handles.push_back(handle);
+    return handle;
+  }
+  const cv::Mat pixels = image.isContinuous() ? image : image.clone();
+  ImageInfo info;
+  info.rows = pixels.rows;
+  info.cols = pixels.cols;
+  info.type = pixels.type();
+  Response response;
+  const size_t bytes = pixels.total() * pixels.elemSize();
+  if (!call(kLoadImage, 0, {{&info, sizeof(info)}, {pixels.data, bytes}}, response)) {
+    return 0;
+  }
+  return response.handle;
+}
+
+SamClient::Handle SamClient::setEmbedding(const std::vector<float>& values,
+                                          const std::vector<float>& intermValues,
+                                          const cv::Size& imageSize) {
+  if (m_server) {
+    const Handle handle = m_server->setEmbedding(values, intermValues, imageSize);
+    if (handle != 0) m_handles.push_back(handle);
+    return handle;
+  }
+  EmbeddingInfo info;
+  info.width = imageSize.width;
+  info.height = imageSize.height;
+  info.numValues = values.size();
+  info.numIntermValues = intermValues.size();
+  Response response;
+  if (!call(kSetEmbedding, 0,
+            {{&info, sizeof(info)},
+             {values.data(), values.size() * sizeof(float)},
+             {intermValues.data(), intermValues.size() * sizeof(float)}},
+            response)) {
+    return 0;
+  }
+  return response.handle;
+}
+
+bool SamClient::getEmbedding(Handle handle, std::vector<float>& values,
+                             std::vector<float>& intermValues, cv::Size& imageSize) {
+  if (m_server) {
+    return m_server->getEmbedding(handle, values, intermValues, imageSize);
+  }
+  Response response;
+  std::vector<char> reply;
+  EmbeddingInfo info;
+  if (!call(kGetEmbedding, handle, {}, response, &reply) || reply.size() < sizeof(info)) {
+    return false;
+  }
+  std::memcpy(&info, reply.data(), sizeof(info));
+  if (reply.size() != sizeof(info) + (info.numValues + info.numIntermValues) * sizeof(float)) {
+    return false;
+  }
+  const float* data = reinterpret_cast<const float*>(reply.data() + sizeof(info));
+  values.assign(data, data + info.numValues);
+  intermValues.assign(data + info.numValues, data + info.numValues + info.numIntermValues);
+  imageSize = cv::Size(info.width, info.height);
+  return true;
+}
+
+bool SamClient::release(Handle handle) {
+  if (m_server) {
+    m_handles.erase(std::remove(m_handles.begin(), m_handles.end(), handle), m_handles.end());
+    return m_server->release(handle);
+  }
+  Response response;
+  return call(kRelease, handle, {}, response);
+}
+
+bool SamClient::getMask(Handle handle, const std::list<cv::Point>& points,
+                        const std::list<cv::Point>& negativePoints, const cv::Rect& roi,
+                        cv::Mat& mask, double* iou) {
+  if (m_server) {
+    const cv::Size size = m_server->getImageSize(handle);
+    if (size.empty()) {
+      std::cerr << "Unknown image handle " << handle << std::endl;
+      return false;
+    }
+    m_mask.create(size, CV_8UC1);
+    if (!m_server->getMask(handle, points, negativePoints, roi, m_mask, iou)) {
+      return false;
+    }
+    mask = m_mask;
+    return true;
+  }
+
+  MaskRequest request;
+  request.numPoints = points.size();
+  request.numNegativePoints = negativePoints.size();
+  request.roi[0] = roi.x;
+  request.roi[1] = roi.y;
+  request.roi[2] = roi.width;
+  request.roi[3] = roi.height;
+  std::vector<int32_t> coordinates;
+  coordinates.reserve((points.size() + negativePoints.size()) * 2);
+  for (const auto* list : {&points, &negativePoints}) {
+    for (const auto& point : *list) {
+      coordinates.push_back(point.x);
+      coordinates.push_back(point.y);
+    }
+  }
+  Response response;
+  if (!call(kGetMask, handle,
+            {{&request, sizeof(request)},
+             {coordinates.data(), coordinates.size() * sizeof(int32_t)}},
+            response) ||
+      response.offset + size_t(response.rows) * response.cols > m_sharedSize) {
+    return false;
+  }
+  mask = cv::Mat(response.rows, response.cols, response.type,
+                 const_cast<uint8_t*>(m_shared + response.offset));
+  if (iou != nullptr) {
+    *iou = response.iou;
+  }
+  return true;
+}
+
+bool SamClient::getMask(Handle handle, const cv::Point& point, cv::Mat& mask, double* iou) {
+  return getMask(handle, {point}, {}, {}, mask, iou);
+}
+
+cv::Mat SamClient::autoSegment(Handle handle, const Sam::AutoSegmentParameter& param,
+                               int* numObjects, std::vector<Sam::AutoSegmentObject>* objects) {
+  if (m_server) {
+    return m_server->autoSegment(handle, param, numObjects, objects);
+  }
+  if (param.cropLayers > 0) {
+    std::cerr << "Crop layers are not supported by the server" << std::endl;
+    return cv::Mat();
+  }
+
+  AutoSegmentRequest request;
+  request.numPointsX = param.numPoints.width;
+  request.numPointsY = param.numPoints.height;
+  request.iouThreshold = param.iouThreshold;
+  request.minArea = param.minArea;
+  request.stabilityThreshold = param.stabilityThreshold;
+  request.stabilityOffset = param.stabilityOffset;
+  request.nmsThreshold = param.nmsThreshold;
+  request.pointsPerBatch = param.pointsPerBatch;
+  request.labelType = param.labelType;
+  request.adaptiveSampling = param.adaptiveSampling;
+  request.adaptiveLevels = param.adaptiveLevels;
+  request.coverageTarget = param.coverageTarget;
+  request.maxDecoderRuns = param.maxDecoderRuns;
+  Response response;
+  std::vector<char> reply;
+  if (!call(kAutoSegment, handle, {{&request, sizeof(request)}}, response, &reply) ||
+      response.offset + size_t(response.rows) * response.cols * CV_ELEM_SIZE(response.type) >
+          m_sharedSize) {
+    return cv::Mat();
+  }
+
+  if (numObjects != nullptr) {
+    *numObjects = response.count;
+  }
+  if (objects != nullptr) {
+    objects->clear();
+    for (size_t i = 0; i + sizeof(Object) <= reply.size(); i += sizeof(Object)) {
+      Object o;
+      std::memcpy(&o, reply.data() + i, sizeof(o));
+      Sam::AutoSegmentObject object;
+      object.label = o.label;
+      object.area = o.area;
+      object.box = cv::Rect(o.box[0], o.box[1], o.box[2], o.box[3]);
+      object.iou = o.iou;
+      object.stability = o.stability;
+      object.point = cv::Point(o.point[0], o.point[1]);
+      objects->push_back(object);
+    }
+  }
+  return cv::Mat(response.rows, response.cols, response.type,
+                 const_cast<uint8_t*>(m_shared + response.offset));
+}
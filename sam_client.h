@@ -0,0 +1,64 @@
+#ifndef SAMCPP__SAM_CLIENT_H_
+#define SAMCPP__SAM_CLIENT_H_
+
+#include <initializer_list>
+#include <utility>
+
+#include "sam_server.h"
+
+namespace sam_protocol {
+struct Response;
+}
+
+// Client of a sam_server, in place of a Sam instance per process. Masks and label images are
+// read-only views of the shared memory of the connection, valid until the next call, so a client
+// is not thread-safe: use one client per worker thread.
+class SamClient {
+ public:
+  using Handle = SamServer::Handle;
+
+  // Connects to the sam_server listening on socketPath
+  SamClient(const std::string& socketPath);
+  // Local stand-in calling server in process, with the same results and view lifetimes as a
+  // connection (to test the clients without a server process)
+  SamClient(const std::shared_ptr<SamServer>& server);
+  ~SamClient();
+  SamClient(const SamClient&) = delete;
+  SamClient& operator=(const SamClient&) = delete;
+
+  bool isConnected() const;
+  cv::Size getInputSize() const;
+  // Handle of the image on the server, 0 on failure
+  Handle loadImage(const cv::Mat& image);
+  Handle setEmbedding(const std::vector<float>& values, const std::vector<float>& intermValues,
+                      const cv::Size& imageSize);
+  bool getEmbedding(Handle handle, std::vector<float>& values, std::vector<float>& intermValues,
+                    cv::Size& imageSize);
+  // Images not released are released when the client is destroyed
+  bool release(Handle handle);
+
+  bool getMask(Handle handle, const std::list<cv::Point>& points,
+               const std::list<cv::Point>& negativePoints, const cv::Rect& roi, cv::Mat& mask,
+               double* iou = nullptr);
+  bool getMask(Handle handle, const cv::Point& point, cv::Mat& mask, double* iou = nullptr);
+  // param.cropLayers must be 0
+  cv::Mat autoSegment(Handle handle, const Sam::AutoSegmentParameter& param,
+                      int* numObjects = nullptr,
+                      std::vector<Sam::AutoSegmentObject>* objects = nullptr);
+
+ private:
+  using Part = std::pair<const void*, size_t>;
+  bool call(uint32_t type, Handle handle, std::initializer_list<Part> payload,
+            sam_protocol::Response& response, std::vector<char>* reply = nullptr);
+  void disconnect();
+
+  std::shared_ptr<SamServer> m_server;
+  std::vector<Handle> m_handles;  // of the local stand-in
+  cv::Mat m_mask;                 // buffer of the local stand-in
+  int m_socket{-1}, m_sharedFd{-1};
+  const uint8_t* m_shared{nullptr};
+  size_t m_sharedSize{0};
+  cv::Size m_inputSize;
+};
+
+#endif  // SAMCPP__SAM_CLIENT_H_
@@ -0,0 +1,330 @@
+#include "sam_embedding_store.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <list>
+#include <map>
+#include <mutex>
+#include <random>
+
+namespace {
+
+using Codec = SamEmbeddingStore::Codec;
+constexpr size_t kInt8Block = 1024;
+
+size_t compressedSize(Codec codec, size_t count) {
+  if (codec == SamEmbeddingStore::kFloat16) {
+    return count * 2;
+  }
+  return (count + kInt8Block - 1) / kInt8Block * 2 * sizeof(float) + count;
+}
+
+// kInt8: the lowest value and the step of each block, then a byte per value
+void compress(Codec codec, const float* values, size_t count, uint8_t* output) {
+  if (codec == SamEmbeddingStore::kFloat16) {
+    cv::Mat half(1, int(count), CV_16F, output);
+    cv::Mat(1, int(count), CV_32F, const_cast<float*>(values)).convertTo(half, CV_16F);
+    return;
+  }
+  const size_t blocks = (count + kInt8Block - 1) / kInt8Block;
+  uint8_t* codes = output + blocks * 2 * sizeof(float);
+  for (size_t b = 0; b < blocks; b++) {
+    const float* block = values + b * kInt8Block;
+    const size_t n = std::min(kInt8Block, count - b * kInt8Block);
+    const auto range = std::minmax_element(block, block + n);
+    const float low = *range.first, step = (*range.second - low) / 255;
+    const float scale = step > 0 ? 1 / step : 0;
+    for (size_t i = 0; i < n; i++) {
+      codes[b * kInt8Block + i] = uint8_t((block[i] - low) * scale + 0.5f);
+    }
+    const float header[2] = {low, step};
+    std::memcpy(output + b * sizeof(header), header, sizeof(header));
+  }
+}
+
+void decompress(Codec codec, const uint8_t* input, size_t count, float* values) {
+  if (codec == SamEmbeddingStore::kFloat16) {
+    cv::Mat full(1, int(count), CV_32F, values);
+    cv::Mat(1, int(count), CV_16F, const_cast<uint8_t*>(input)).convertTo(full, CV_32F);
+    return;
+  }
+  const size_t blocks = (count + kInt8Block - 1) / kInt8Block;
+  const uint8_t* codes = input + blocks * 2 * sizeof(float);
+  for (size_t b = 0; b < blocks; b++) {
+    float header[2];
+    std::memcpy(header, input + b * sizeof(header), sizeof(header));
+    const size_t n = std::min(kInt8Block, count - b * kInt8Block);
+    for (size_t i = 0; i < n; i++) {
+      values[b * kInt8Block + i] = header[0] + codes[b * kInt8Block + i] * header[1];
+    }
+  }
+}
+
+}  // namespace
+
+struct SamEmbeddingStoreData {
+  using Key = SamEmbeddingStore::Key;
+  enum Tier { kHot, kCold, kDisk };
+  struct Entry {
+    Tier tier{kHot};
+    cv::Size imageSize;
+    size_t numValues{0}, numIntermValues{0};
+    std::shared_ptr<std::vector<float>> values;  // hot: values followed by intermValues
+    std::vector<uint8_t> compressed;             // cold
+    size_t diskBytes{0};                         // disk
+    std::list<Key>::iterator lru;                // in the list of its tier
+  };
+
+  SamEmbeddingStore::Parameter param;
+  std::string filePrefix;  // of the files of the store in param.coldDir
+  mutable std::mutex mutex;
+  std::map<Key, Entry> entries;
+  std::list<Key> lru[3];  // keys of each tier, most recently used first
+  SamEmbeddingStore::Stats stats;
+
+  std::string path(Key key) const {
+    return (std::filesystem::path(param.coldDir) / (filePrefix + std::to_string(key) + ".emb"))
+        .string();
+  }
+
+  // Adds (sign 1) or removes (sign -1) entry from the counters of its tier
+  void account(const Entry& entry, int sign) {
+    switch (entry.tier) {
+      case kHot:
+        stats.hotCount += sign;
+        stats.hotBytes += sign * entry.values->size() * sizeof(float);
+        break;
+      case kCold:
+        stats.coldCount += sign;
+        stats.coldBytes += sign * entry.compressed.size();
+        break;
+      case kDisk:
+        stats.diskCount += sign;
+        stats.diskBytes += sign * entry.diskBytes;
+        break;
+    }
+  }
+
+  void erase(std::map<Key, Entry>::iterator it) {
+    account(it->second, -1);
+    lru[it->second.tier].erase(it->second.lru);
+    if (it->second.tier == kDisk) {
+      std::error_code error;
+      std::filesystem::remove(path(it->first), error);
+    }
+    entries.erase(it);
+  }
+
+  // Moves entry to tier, its data being already converted
+  void move(Key key, Entry& entry, Tier tier) {
+    lru[entry.tier].erase(entry.lru);
+    entry.tier = tier;
+    lru[tier].push_front(key);
+    entry.lru = lru[tier].begin();
+  }
+
+  void demote(Key key, Entry& entry) {
+    const size_t count = entry.values->size();
+    account(entry, -1);
+    entry.compressed.resize(compressedSize(param.codec, count));
+    compress(param.codec, entry.values->data(), count, entry.compressed.data());
+    entry.values.reset();
+    move(key, entry, kCold);
+    account(entry, 1);
+    stats.demotions++;
+  }
+
+  // Cold entry to a file, dropped if the file can't be written
+  void spill(std::map<Key, Entry>::iterator it) {
+    auto& entry = it->second;
+    std::ofstream file(path(it->first), std::ios::binary | std::ios::trunc);
+    file.write(reinterpret_cast<const char*>(entry.compressed.data()), entry.compressed.size());
+    if (!file.good()) {
+      std::cerr << "Unable to write " << path(it->first) << std::endl;
+      file.close();
+      std::error_code error;
+      std::filesystem::remove(path(it->first), error);
+      erase(it);
+      stats.evictions++;
+      return;
+    }
+    account(entry, -1);
+    entry.diskBytes = entry.compressed.size();
+    entry.compressed = std::vector<uint8_t>();
+    move(it->first, entry, kDisk);
+    account(entry, 1);
+  }
+
+  bool promote(Key key, Entry& entry) {
+    const auto start = std::chrono::steady_clock::now();
+    const size_t count = entry.numValues + entry.numIntermValues;
+    if (entry.tier == kDisk) {
+      std::vector<uint8_t> compressed(entry.diskBytes);
+      std::ifstream file(path(key), std::ios::binary);
+      file.read(reinterpret_cast<char*>(compressed.data()), compressed.size());
+      if (!file.good()) {
+        std::cerr << "Unable to read " << path(key) << std::endl;
+        return false;
+      }
+      file.close();
+      account(entry, -1);
+      std::error_code error;
+      std::filesystem::remove(path(key), error);
+      entry.diskBytes = 0;
+      entry.compressed = std::move(compressed);
+    } else {
+      account(entry, -1);
+    }
+    entry.values = std::make_shared<std::vector<float>>(count);
+    decompress(param.codec, entry.compressed.data(), count, entry.values->data());
+    entry.compressed = std::vector<uint8_t>();
+    move(key, entry, kHot);
+    account(entry, 1);
+    stats.promotions++;
+    stats.promotionMs += std::chrono::duration<double, std::milli>(
+                             std::chrono::steady_clock::now() - start)
+                             .count();
+    return true;
+  }
+
+  // Stores entry (hot) as key, replacing the previous one
+  void insert(Key key, Entry& entry) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = entries.find(key);
+    if (it != entries.end()) {
+      erase(it);
+    }
+    lru[kHot].push_front(key);
+    entry.lru = lru[kHot].begin();
+    account(entry, 1);
+    entries.emplace(key, std::move(entry));
+    enforce(key);
+  }
+
+  // Demotes the least recently used embeddings over the budgets, except key
+  void enforce(Key key) {
+    while (stats.hotBytes > param.hotBytes && !lru[kHot].empty() && lru[kHot].back() != key) {
+      const Key demoted = lru[kHot].back();
+      demote(demoted, entries[demoted]);
+    }
+    while (stats.coldBytes > param.coldBytes && !lru[kCold].empty()) {
+      auto it = entries.find(lru[kCold].back());
+      if (param.coldDir.empty()) {
+        erase(it);
+        stats.evictions++;
+      } else {
+        spill(it);
+      }
+    }
+  }
+};
+
+SamEmbeddingStore::SamEmbeddingStore(const Parameter& param) : m_data(new SamEmbeddingStoreData) {
+  m_data->param = param;
+  if (!param.coldDir.empty()) {
+    std::error_code error;
+    std::filesystem::create_directories(param.coldDir, error);
+    m_data->filePrefix = std::to_string(std::random_device()()) + "-";
+  }
+}
+
+SamEmbeddingStore::~SamEmbeddingStore() {
+  for (const auto& key : m_data->lru[SamEmbeddingStoreData::kDisk]) {
+    std::error_code error;
+    std::filesystem::remove(m_data->path(key), error);
+  }
+  delete m_data;
+}
+
+bool SamEmbeddingStore::put(Key key, const Sam& sam) {
+  // Copied once, from the embedding of sam to the entry
+  SamEmbeddingStoreData::Entry entry;
+  if (!sam.readEmbedding([&](const float* values, size_t numValues, const float* intermValues,
+                             size_t numIntermValues, const cv::Size& imageSize) {
+        entry.imageSize = imageSize;
+        entry.numValues = numValues;
+        entry.numIntermValues = numIntermValues;
+        entry.values = std::make_shared<std::vector<float>>();
+        entry.values->reserve(numValues + numIntermValues);
+        entry.values->insert(entry.values->end(), values, values + numValues);
+        entry.values->insert(entry.values->end(), intermValues, intermValues + numIntermValues);
+        return true;
+      })) {
+    return false;
+  }
+  m_data->insert(key, entry);
+  return true;
+}
+
+bool SamEmbeddingStore::put(Key key, const std::vector<float>& values,
+                            const std::vector<float>& intermValues, const cv::Size& imageSize) {
+  if (values.empty() || imageSize.empty()) {
+    std::cerr << "Image not loaded" << std::endl;
+    return false;
+  }
+  SamEmbeddingStoreData::Entry entry;
+  entry.imageSize = imageSize;
+  entry.numValues = values.size();
+  entry.numIntermValues = intermValues.size();
+  entry.values = std::make_shared<std::vector<float>>();
+  entry.values->reserve(values.size() + intermValues.size());
+  entry.values->insert(entry.values->end(), values.begin(), values.end());
+  entry.values->insert(entry.values->end(), intermValues.begin(), intermValues.end());
+  m_data->insert(key, entry);
+  return true;
+}
+
+bool SamEmbeddingStore::load(Key key, Sam& sam) {
+  std::shared_ptr<std::vector<float>> values;
+  size_t numValues = 0;
+  cv::Size imageSize;
+  {
+    std::lock_guard<std::mutex> lock(m_data->mutex);
+    auto it = m_data->entries.find(key);
+    if (it == m_data->entries.end()) {
+      std::cerr << "Unknown embedding " << key << std::endl;
+      return false;
+    }
+    auto& entry = it->second;
+    if (entry.tier != SamEmbeddingStoreData::kHot) {
+      if (!m_data->promote(key, entry)) {
+        m_data->erase(it);
+        m_data->stats.evictions++;
+        return false;
+      }
+    } else {
+      m_data->move(key, entry, SamEmbeddingStoreData::kHot);
+    }
+    m_data->enforce(key);
+    values = entry.values;
+    numValues = entry.numValues;
+    imageSize = entry.imageSize;
+  }
+  // sam shares the hot copy, which outlives its demotion until sam loads another embedding
+  return sam.setEmbedding(values->data(), numValues, values->data() + numValues,
+                          values->size() - numValues, imageSize, values);
+}
+
+bool SamEmbeddingStore::contains(Key key) const {
+  std::lock_guard<std::mutex> lock(m_data->mutex);
+  return m_data->entries.count(key) > 0;
+}
+
+bool SamEmbeddingStore::remove(Key key) {
+  std::lock_guard<std::mutex> lock(m_data->mutex);
+  auto it = m_data->entries.find(key);
+  if (it == m_data->entries.end()) {
+    return false;
+  }
+  m_data->erase(it);
+  return true;
+}
+
+SamEmbeddingStore::Stats SamEmbeddingStore::getStats() const {
+  std::lock_guard<std::mutex> lock(m_data->mutex);
+  return m_data->stats;
+}
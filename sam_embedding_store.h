@@ -0,0 +1,59 @@
+#ifndef SAMCPP__SAM_EMBEDDING_STORE_H_
+#define SAMCPP__SAM_EMBEDDING_STORE_H_
+
+#include "sam.h"
+
+struct SamEmbeddingStoreData;
+
+// Embeddings of many images under a memory budget: the recently used ones are kept as they are
+// (hot), the others compressed in memory and, beyond its budget, in files (cold). Loading a cold
+// embedding decompresses it in milliseconds instead of encoding its image again. Thread-safe.
+#if _MSC_VER
+class __declspec(dllexport) SamEmbeddingStore {
+#else
+class SamEmbeddingStore {
+#endif
+  SamEmbeddingStoreData* m_data{nullptr};
+
+ public:
+  using Key = uint64_t;
+  // Lossy codecs of the cold embeddings
+  enum Codec {
+    kFloat16,  // half the size, relative error below 1e-3
+    kInt8,     // a quarter of the size, 8 bits per value with a range per block of 1024 values
+  };
+  struct Parameter {
+    size_t hotBytes{size_t(1) << 30};   // uncompressed embeddings
+    size_t coldBytes{size_t(4) << 30};  // compressed embeddings in memory
+    // Directory of the compressed embeddings beyond coldBytes (files removed with the store),
+    // the least recently used ones are dropped if empty
+    std::string coldDir;
+    Codec codec{kFloat16};
+  };
+  struct Stats {
+    size_t hotCount{0}, hotBytes{0}, coldCount{0}, coldBytes{0}, diskCount{0}, diskBytes{0};
+    // Embeddings decompressed on load, compressed when leaving the hot tier and dropped from the
+    // cold tier
+    int64_t promotions{0}, demotions{0}, evictions{0};
+    double promotionMs{0};  // total time of the promotions
+  };
+
+  SamEmbeddingStore(const Parameter& param);
+  ~SamEmbeddingStore();
+  SamEmbeddingStore(const SamEmbeddingStore&) = delete;
+  SamEmbeddingStore& operator=(const SamEmbeddingStore&) = delete;
+
+  // Stores the embedding of the image loaded by sam as key (hot), replacing the previous one
+  bool put(Key key, const Sam& sam);
+  bool put(Key key, const std::vector<float>& values, const std::vector<float>& intermValues,
+           const cv::Size& imageSize);
+  // Sets the embedding of key on sam without copying it (promoted to the hot tier if needed),
+  // false if key is unknown or was dropped. Demoted embeddings stay allocated until sam loads
+  // another one.
+  bool load(Key key, Sam& sam);
+  bool contains(Key key) const;
+  bool remove(Key key);
+  Stats getStats() const;
+};
+
+#endif  // SAMCPP__SAM_EMBEDDING_STORE_H_
@@ -0,0 +1,120 @@
+#ifndef SAMCPP__SAM_PROTOCOL_H_
+#define SAMCPP__SAM_PROTOCOL_H_
+
+#include <sys/socket.h>
+
+#include <cerrno>
+#include <cstdint>
+
+// Binary protocol between sam_server and SamClient over a local Unix-domain socket, both ends
+// running on the same machine (native byte order and struct layout)
+//
+// On connection the server sends a Response carrying the file descriptor of the shared memory
+// of the connection (SCM_RIGHTS). Then each request is a Header followed by header.size bytes of
+// payload, answered by a Response followed by response.size bytes of payload. Masks and label
+// images are written to the shared memory, at response.offset, and stay there until the next
+// request of the connection.
+namespace sam_protocol {
+
+constexpr uint32_t kMagic = 0x314d4153;  // "SAM1"
+constexpr uint64_t kMaxPayload = uint64_t(1) << 30;
+// Bounds of the sizes chosen by clients, which size the allocations of the server
+constexpr int32_t kMaxImageSide = 16384;
+constexpr int32_t kMaxGridPoints = 1024;  // per side of the autoSegment grid
+constexpr int32_t kMaxPointsPerBatch = 1024;
+
+enum Type : uint32_t {
+  kInputSize,     // -> rows, cols
+  kLoadImage,     // ImageInfo, pixels -> handle
+  kSetEmbedding,  // EmbeddingInfo, values, intermValues -> handle
+  kGetEmbedding,  // handle -> EmbeddingInfo, values, intermValues
+  kRelease,       // handle
+  kGetMask,       // handle, MaskRequest, points -> iou, mask in shared memory
+  kAutoSegment,   // handle, AutoSegmentRequest -> count, Objects, labels in shared memory
+};
+
+struct Header {
+  uint32_t magic{kMagic}, type{0};
+  uint64_t handle{0};  // image loaded by kLoadImage or kSetEmbedding
+  uint64_t size{0};    // bytes of payload
+};
+
+struct Response {
+  uint32_t magic{kMagic};
+  int32_t status{-1};  // 0 on success
+  uint64_t handle{0};
+  double iou{0};
+  int32_t rows{0}, cols{0}, type{0}, count{0};
+  uint64_t offset{0};      // of the image in the shared memory
+  uint64_t bufferSize{0};  // current size of the shared memory (grows, never shrinks)
+  uint64_t size{0};        // bytes of payload
+};
+
+struct ImageInfo {
+  int32_t rows{0}, cols{0}, type{0};  // followed by rows * cols * elemSize bytes of pixels
+};
+
+struct EmbeddingInfo {
+  int32_t width{0}, height{0};  // size of the image the embedding was computed from
+  uint64_t numValues{0}, numIntermValues{0};
+};
+
+struct MaskRequest {
+  int32_t numPoints{0}, numNegativePoints{0};  // followed by (x, y) int32 pairs, positive first
+  int32_t roi[4]{};                            // x, y, width, height (empty for none)
+};
+
+// Crop layers are not supported, the server not keeping the images
+struct AutoSegmentRequest {
+  int32_t numPointsX{0}, numPointsY{0};
+  double iouThreshold{0}, minArea{0}, stabilityThreshold{0}, stabilityOffset{0}, nmsThreshold{0};
+  int32_t pointsPerBatch{0}, labelType{0};
+  int32_t adaptiveSampling{0}, adaptiveLevels{0};
+  double coverageTarget{0};
+  int32_t maxDecoderRuns{0};
+};
+
+struct Object {
+  int32_t label{0}, area{0};
+  int32_t box[4]{};
+  double iou{0}, stability{0};
+  int32_t point[2]{};
+};
+
+// Blocking socket I/O of whole messages, false once the connection is closed
+inline bool readAll(int fd, void* data, size_t size) {
+  auto p = static_cast<char*>(data);
+  while (size > 0) {
+    const ssize_t n = recv(fd, p, size, 0);
+    if (n <= 0) {
+      if (n < 0 && errno == EINTR) continue;
+      return false;
+    }
+    p += n;
+    size -= n;
+  }
+  return true;
+}
+
+inline bool writeAll(int fd, const void* data, size_t size) {
+#ifdef MSG_NOSIGNAL
+  const int flags = MSG_NOSIGNAL;
+#else
+  const int flags = 0;
+#endif
+  auto p = static_cast<const char*>(data);
+  while (size > 0) {
+    const ssize_t n = send(fd, p, size, flags);
+    if (n <= 0) {
+      if (n < 0 && errno == EINTR) continue;
+      return false;
+    }
+    p += n;
+    size -= n;
+  }
+  return true;
+}
+
+}  // namespace sam_protocol
+
+#endif  // SAMCPP__SAM_PROTOCOL_H_
@@ -0,0 +1,470 @@
+#include "sam_server.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <exception>
+#include <iostream>
+#include <list>
+#include <thread>
+
+#include "sam_protocol.h"
+
+namespace {
+
+// Shared memory of a connection, unlinked at once and passed to the client as a descriptor
+struct SharedBuffer {
+  int fd{-1};
+  uint8_t* data{nullptr};
+  size_t size{0};
+
+  ~SharedBuffer() {
+    if (data != nullptr) munmap(data, size);
+    if (fd >= 0) close(fd);
+  }
+  bool create() {
+    static std::atomic<int> counter{0};
+    const auto name =
+        "/sam_server_" + std::to_string(getpid()) + "_" + std::to_string(counter++);
+    fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0) {
+      return false;
+    }
+    shm_unlink(name.c_str());
+    return true;
+  }
+  // Grow to at least bytes (the client remaps it from the size of the next response)
+  uint8_t* reserve(size_t bytes) {
+    if (bytes <= size && data != nullptr) {
+      return data;
+    }
+    const size_t page = sysconf(_SC_PAGESIZE);
+    const size_t newSize = (std::max(bytes, size * 2) + page - 1) / page * page;
+    if (data != nullptr) {
+      munmap(data, size);
+      data = nullptr;
+      size = 0;
+    }
+    if (ftruncate(fd, newSize) != 0) {
+      return nullptr;
+    }
+    void* p = mmap(nullptr, newSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) {
+      return nullptr;
+    }
+    data = static_cast<uint8_t*>(p);
+    size = newSize;
+    return data;
+  }
+};
+
+bool sendWithFd(int socket, const void* data, size_t size, int fd) {
+  iovec iov{const_cast<void*>(data), size};
+  char control[CMSG_SPACE(sizeof(int))] = {};
+  msghdr msg{};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  std::memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+  return sendmsg(socket, &msg, 0) == ssize_t(size);
+}
+
+// Bounds-checked reads of a request payload
+struct Reader {
+  const char* p;
+  size_t left;
+
+  bool read(void* data, size_t size) {
+    if (size > left) {
+      return false;
+    }
+    std::memcpy(data, p, size);
+    p += size;
+    left -= size;
+    return true;
+  }
+  template <typename T>
+  bool read(T& value) {
+    return read(&value, sizeof(T));
+  }
+};
+
+void append(std::vector<char>& reply, const void* data, size_t size) {
+  reply.insert(reply.end(), static_cast<const char*>(data), static_cast<const char*>(data) + size);
+}
+
+}  // namespace
+
+SamServer::SamServer(const Sam::Parameter& param)
+    : m_param(param),
+      m_sharedModel(Sam::createSharedModel()),
+      m_sam(new Sam(param, m_sharedModel)) {}
+
+cv::Size SamServer::getInputSize() const { return m_sam->getInputSize(); }
+
+SamServer::Handle SamServer::add(const std::shared_ptr<Sam>& sam, const cv::Size& size) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  const Handle handle = m_nextHandle++;
+  m_images[handle] = {sam, size};
+  return handle;
+}
+
+std::shared_ptr<Sam> SamServer::find(Handle handle) const {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  auto it = m_images.find(handle);
+  if (it == m_images.end()) {
+    std::cerr << "Unknown image handle " << handle << std::endl;
+    return nullptr;
+  }
+  return it->second.sam;
+}
+
+SamServer::Handle SamServer::loadImage(const cv::Mat& image) {
+  if (getInputSize().empty()) {
+    return 0;
+  }
+  auto sam = std::make_shared<Sam>(m_param, m_sharedModel);
+  if (!sam->loadImage(image)) {
+    return 0;
+  }
+  return add(sam, image.size());
+}
+
+SamServer::Handle SamServer::setEmbedding(const std::vector<float>& values,
+                                          const std::vector<float>& intermValues,
+                                          const cv::Size& imageSize) {
+  if (getInputSize().empty()) {
+    return 0;
+  }
+  auto sam = std::make_shared<Sam>(m_param, m_sharedModel);
+  if (!sam->setEmbedding(values, intermValues, imageSize)) {
+    return 0;
+  }
+  return add(sam, imageSize);
+}
+
+bool SamServer::getEmbedding(Handle handle, std::vector<float>& values,
+                             std::vector<float>& intermValues, cv::Size& imageSize) const {
+  auto sam = find(handle);
+  return sam && sam->getEmbedding(values, intermValues, imageSize);
+}
+
+bool SamServer::release(Handle handle) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  return m_images.erase(handle) > 0;
+}
+
+cv::Size SamServer::getImageSize(Handle handle) const {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  auto it = m_images.find(handle);
+  return it != m_images.end() ? it->second.size : cv::Size();
+}
+
+bool SamServer::getMask(Handle handle, const std::list<cv::Point>& points,
+                        const std::list<cv::Point>& negativePoints, const cv::Rect& roi,
+                        cv::Mat& mask, double* iou) const {
+  auto sam = find(handle);
+  return sam && sam->getMask(points, negativePoints, roi, mask, iou);
+}
+
+cv::Mat SamServer::autoSegment(Handle handle, const Sam::AutoSegmentParameter& param,
+                               int* numObjects,
+                               std::vector<Sam::AutoSegmentObject>* objects) const {
+  if (param.cropLayers > 0) {
+    std::cerr << "Crop layers are not supported by the server" << std::endl;
+    return cv::Mat();
+  }
+  auto sam = find(handle);
+  if (!sam) {
+    return cv::Mat();
+  }
+  return sam->autoSegment(param, nullptr, numObjects, objects);
+}
+
+void SamServer::serveConnection(int fd) {
+  using namespace sam_protocol;
+
+  SharedBuffer buffer;
+  const cv::Size inputSize = getInputSize();
+  Response hello;
+  hello.status = 0;
+  if (!buffer.create() || !buffer.reserve(inputSize.area())) {
+    std::cerr << "Unable to create the shared memory: " << std::strerror(errno) << std::endl;
+    return;
+  }
+  hello.rows = inputSize.height;
+  hello.cols = inputSize.width;
+  hello.bufferSize = buffer.size;
+  if (!sendWithFd(fd, &hello, sizeof(hello), buffer.fd)) {
+    return;
+  }
+
+  std::vector<Handle> handles;  // released when the connection closes
+  std::vector<char> payload, reply;
+  Header header;
+  // The images of other connections are unknown to this one
+  auto isOwned = [&]() {
+    if (std::find(handles.begin(), handles.end(), header.handle) == handles.end()) {
+      std::cerr << "Unknown image handle " << header.handle << std::endl;
+      return false;
+    }
+    return true;
+  };
+  while (readAll(fd, &header, sizeof(header))) {
+    if (header.magic != kMagic || header.size > kMaxPayload) {
+      std::cerr << "Invalid request" << std::endl;
+      break;
+    }
+    payload.resize(header.size);
+    if (!readAll(fd, payload.data(), payload.size())) {
+      break;
+    }
+    Reader reader{payload.data(), payload.size()};
+    Response response;
+    reply.clear();
+    bool bOk = false;
+
+    // A failed request (e.g. out of memory or a runtime error) only fails its response
+    try {
+      switch (header.type) {
+        case kInputSize: {
+          response.rows = inputSize.height;
+          response.cols = inputSize.width;
+          bOk = !inputSize.empty();
+          break;
+        }
+        case kLoadImage: {
+          ImageInfo info;
+          if (!reader.read(info) || info.rows <= 0 || info.cols <= 0 ||
+              reader.left != size_t(info.rows) * info.cols * CV_ELEM_SIZE(info.type)) {
+            break;
+          }
+          const cv::Mat image(info.rows, info.cols, info.type, const_cast<char*>(reader.p));
+          response.handle = loadImage(image);
+          bOk = response.handle != 0;
+          break;
+        }
+        case kSetEmbedding: {
+          EmbeddingInfo info;
+          if (!reader.read(info) || info.width <= 0 || info.height <= 0 ||
+              info.width > kMaxImageSide || info.height > kMaxImageSide ||
+              reader.left != (info.numValues + info.numIntermValues) * sizeof(float)) {
+            break;
+          }
+          std::vector<float> values(info.numValues), intermValues(info.numIntermValues);
+          reader.read(values.data(), values.size() * sizeof(float));
+          reader.read(intermValues.data(), intermValues.size() * sizeof(float));
+          response.handle = setEmbedding(values, intermValues, cv::Size(info.width, info.height));
+          bOk = response.handle != 0;
+          break;
+        }
+        case kGetEmbedding: {
+          std::vector<float> values, intermValues;
+          cv::Size imageSize;
+          if (!isOwned() || !getEmbedding(header.handle, values, intermValues, imageSize)) {
+            break;
+          }
+          EmbeddingInfo info;
+          info.width = imageSize.width;
+          info.height = imageSize.height;
+          info.numValues = values.size();
+          info.numIntermValues = intermValues.size();
+          append(reply, &info, sizeof(info));
+          append(reply, values.data(), values.size() * sizeof(float));
+          append(reply, intermValues.data(), intermValues.size() * sizeof(float));
+          bOk = true;
+          break;
+        }
+        case kRelease: {
+          bOk = isOwned() && release(header.handle);
+          handles.erase(std::remove(handles.begin(), handles.end(), header.handle), handles.end());
+          break;
+        }
+        case kGetMask: {
+          MaskRequest request;
+          if (!isOwned() || !reader.read(request) || request.numPoints < 0 ||
+              request.numNegativePoints < 0) {
+            break;
+          }
+          const size_t numPoints = size_t(request.numPoints) + request.numNegativePoints;
+          if (reader.left != numPoints * 2 * sizeof(int32_t)) {
+            break;
+          }
+          std::list<cv::Point> points, negativePoints;
+          for (size_t i = 0; i < numPoints; i++) {
+            int32_t xy[2];
+            reader.read(xy);
+            (i < size_t(request.numPoints) ? points : negativePoints).emplace_back(xy[0], xy[1]);
+          }
+          const cv::Rect roi(request.roi[0], request.roi[1], request.roi[2], request.roi[3]);
+          const cv::Size size = getImageSize(header.handle);
+          uint8_t* data = size.empty() ? nullptr : buffer.reserve(size.area());
+          if (data == nullptr) {
+            break;
+          }
+          // The decoder output is thresholded straight into the shared memory
+          cv::Mat mask(size, CV_8UC1, data);
+          bOk = getMask(header.handle, points, negativePoints, roi, mask, &response.iou) &&
+                mask.data == data;
+          response.rows = size.height;
+          response.cols = size.width;
+          response.type = CV_8UC1;
+          break;
+        }
+        case kAutoSegment: {
+          AutoSegmentRequest request;
+          if (!isOwned() || !reader.read(request) || request.numPointsX <= 0 ||
+              request.numPointsY <= 0 || request.numPointsX > kMaxGridPoints ||
+              request.numPointsY > kMaxGridPoints || request.pointsPerBatch > kMaxPointsPerBatch) {
+            break;
+          }
+          Sam::AutoSegmentParameter param(cv::Size(request.numPointsX, request.numPointsY));
+          param.iouThreshold = request.iouThreshold;
+          param.minArea = request.minArea;
+          param.stabilityThreshold = request.stabilityThreshold;
+          param.stabilityOffset = request.stabilityOffset;
+          param.nmsThreshold = request.nmsThreshold;
+          param.pointsPerBatch = request.pointsPerBatch;
+          param.labelType = request.labelType;
+          param.adaptiveSampling = request.adaptiveSampling != 0;
+          param.adaptiveLevels = request.adaptiveLevels;
+          param.coverageTarget = request.coverageTarget;
+          param.maxDecoderRuns = request.maxDecoderRuns;
+          int numObjects = 0;
+          std::vector<Sam::AutoSegmentObject> objects;
+          // The label image is built by autoSegment, then copied once into the shared memory
+          const cv::Mat labels = autoSegment(header.handle, param, &numObjects, &objects);
+          const size_t bytes = labels.total() * labels.elemSize();
+          uint8_t* data = labels.empty() ? nullptr : buffer.reserve(bytes);
+          if (data == nullptr || !labels.isContinuous()) {
+            break;
+          }
+          std::memcpy(data, labels.data, bytes);
+          for (const auto& object : objects) {
+            Object o;
+            o.label = object.label;
+            o.area = object.area;
+            o.box[0] = object.box.x;
+            o.box[1] = object.box.y;
+            o.box[2] = object.box.width;
+            o.box[3] = object.box.height;
+            o.iou = object.iou;
+            o.stability = object.stability;
+            o.point[0] = object.point.x;
+            o.point[1] = object.point.y;
+            append(reply, &o, sizeof(o));
+          }
+          response.rows = labels.rows;
+          response.cols = labels.cols;
+          response.type = labels.type();
+          response.count = numObjects;
+          bOk = true;
+          break;
+        }
+        default:
+          std::cerr << "Unknown request type " << header.type << std::endl;
+          break;
+      }
+    } catch (const std::exception& e) {
+      std::cerr << "Request failed: " << e.what() << std::endl;
+      bOk = false;
+      reply.clear();
+    } catch (...) {
+      std::cerr << "Request failed" << std::endl;
+      bOk = false;
+      reply.clear();
+    }
+
+    if (bOk && (header.type == kLoadImage || header.type == kSetEmbedding)) {
+      handles.push_back(response.handle);
+    }
+    response.status = bOk ? 0 : -1;
+    response.bufferSize = buffer.size;
+    response.size = reply.size();
+    if (!writeAll(fd, &response, sizeof(response)) || !writeAll(fd, reply.data(), reply.size())) {
+      break;
+    }
+  }
+
+  for (auto handle : handles) {
+    release(handle);
+  }
+}
+
+bool SamServer::serve(const std::string& socketPath, const std::atomic<bool>& stop) {
+  if (getInputSize().empty()) {
+    std::cerr << "Model not loaded" << std::endl;
+    return false;
+  }
+  sockaddr_un address{};
+  address.sun_family = AF_UNIX;
+  if (socketPath.size() >= sizeof(address.sun_path)) {
+    std::cerr << "Socket path too long: " << socketPath << std::endl;
+    return false;
+  }
+  std::strncpy(address.sun_path, socketPath.c_str(), sizeof(address.sun_path) - 1);
+
+  const int listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+  unlink(socketPath.c_str());
+  if (listenFd < 0 || bind(listenFd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 ||
+      listen(listenFd, SOMAXCONN) != 0) {
+    std::cerr << "Unable to listen on " << socketPath << ": " << std::strerror(errno) << std::endl;
+    if (listenFd >= 0) close(listenFd);
+    return false;
+  }
+
+  struct Connection {
+    int fd{-1};
+    std::thread thread;
+    std::atomic<bool> bDone{false};
+  };
+  std::list<Connection> connections;
+  while (!stop) {
+    for (auto it = connections.begin(); it != connections.end();) {
+      if (it->bDone) {
+        it->thread.join();
+        close(it->fd);
+        it = connections.erase(it);
+      } else {
+        ++it;
+      }
+    }
+    // Wake up regularly to check stop
+    pollfd listening{listenFd, POLLIN, 0};
+    if (poll(&listening, 1, 100) <= 0) {
+      continue;
+    }
+    const int fd = accept(listenFd, nullptr, nullptr);
+    if (fd < 0) {
+      continue;
+    }
+    connections.emplace_back();
+    auto& connection = connections.back();
+    connection.fd = fd;
+    connection.thread = std::thread([this, &connection] {
+      serveConnection(connection.fd);
+      connection.bDone = true;
+    });
+  }
+
+  // Unblock the connections still open
+  for (auto& connection : connections) {
+    shutdown(connection.fd, SHUT_RDWR);
+    connection.thread.join();
+    close(connection.fd);
+  }
+  close(listenFd);
+  unlink(socketPath.c_str());
+  return true;
+}
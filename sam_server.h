@@ -0,0 +1,61 @@
+#ifndef SAMCPP__SAM_SERVER_H_
+#define SAMCPP__SAM_SERVER_H_
+
+#include <atomic>
+#include <map>
+#include <mutex>
+
+#include "sam.h"
+
+// Serves the images of several processes with a single copy of the models: each loaded image
+// is an instance of a shared model (sharing its sessions) identified by a handle
+class SamServer {
+ public:
+  using Handle = uint64_t;
+
+  SamServer(const Sam::Parameter& param);
+
+  // Empty if the models are not loaded
+  cv::Size getInputSize() const;
+  // Handle of the new image, 0 on failure
+  Handle loadImage(const cv::Mat& image);
+  Handle setEmbedding(const std::vector<float>& values, const std::vector<float>& intermValues,
+                      const cv::Size& imageSize);
+  bool getEmbedding(Handle handle, std::vector<float>& values, std::vector<float>& intermValues,
+                    cv::Size& imageSize) const;
+  bool release(Handle handle);
+  // Size of the masks of an image, empty for an unknown handle
+  cv::Size getImageSize(Handle handle) const;
+
+  // Writes the mask into mask, in place if it is already a CV_8UC1 image of getImageSize
+  bool getMask(Handle handle, const std::list<cv::Point>& points,
+               const std::list<cv::Point>& negativePoints, const cv::Rect& roi, cv::Mat& mask,
+               double* iou = nullptr) const;
+  // param.cropLayers must be 0 (the images are not kept)
+  cv::Mat autoSegment(Handle handle, const Sam::AutoSegmentParameter& param,
+                      int* numObjects = nullptr,
+                      std::vector<Sam::AutoSegmentObject>* objects = nullptr) const;
+
+  // Accept connections on a Unix-domain socket at socketPath until stop is set, each one served
+  // by its own thread, the images of a connection being released when it closes and unknown to
+  // the other connections (Unix only)
+  bool serve(const std::string& socketPath, const std::atomic<bool>& stop);
+
+ private:
+  struct Image {
+    std::shared_ptr<Sam> sam;
+    cv::Size size;
+  };
+  std::shared_ptr<Sam> find(Handle handle) const;
+  Handle add(const std::shared_ptr<Sam>& sam, const cv::Size& size);
+  void serveConnection(int fd);
+
+  Sam::Parameter m_param;
+  Sam::SharedModel m_sharedModel;
+  std::unique_ptr<Sam> m_sam;  // keeps the sessions loaded while no image is
+  mutable std::mutex m_mutex;
+  std::map<Handle, Image> m_images;
+  Handle m_nextHandle{1};
+};
+
+#endif  // SAMCPP__SAM_SERVER_H_
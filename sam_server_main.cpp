@@ -0,0 +1,122 @@
+#include <atomic>
+#include <csignal>
+#include <opencv2/opencv.hpp>
+#include <thread>
+
+#define STRIP_FLAG_HELP 1
+#include <gflags/gflags.h>
+
+#include "sam_client.h"
+
+DEFINE_string(pre_model, "models/sam_preprocess.onnx", "Path to the preprocessing model");
+DEFINE_string(sam_model, "models/sam_vit_h_4b8939.onnx", "Path to the sam model");
+DEFINE_string(pre_device, "cpu", "cpu or cuda:0(1,2,3...)");
+DEFINE_string(sam_device, "cpu", "cpu or cuda:0(1,2,3...)");
+DEFINE_string(socket, "/tmp/sam_server.sock", "Path of the Unix-domain socket");
+DEFINE_int32(threads, 0, "Number of threads of the global thread pools (0 for all cores)");
+DEFINE_string(self_check, "",
+              "Image to segment through a connection and through the local stand-in client, "
+              "exits with an error if the results differ");
+DEFINE_bool(h, false, "Show help");
+
+static std::atomic<bool> g_stop{false};
+
+static bool parseDeviceName(const std::string& name, Sam::Parameter::Provider& provider) {
+  if (name == "cpu") {
+    provider.deviceType = 0;
+    return true;
+  }
+  if (name.substr(0, 5) == "cuda:") {
+    provider.deviceType = 1;
+    provider.gpuDeviceId = std::stoi(name.substr(5));
+    return true;
+  }
+  return false;
+}
+
+// Same prompts through both clients, masks and labels must be identical
+static bool selfCheck(const std::shared_ptr<SamServer>& server) {
+  cv::Mat image = cv::imread(FLAGS_self_check, -1);
+  if (image.empty()) {
+    std::cerr << "Image loading failed" << std::endl;
+    return false;
+  }
+  cv::resize(image, image, server->getInputSize());
+
+  SamClient remote(FLAGS_socket), local(server);
+  const auto remoteImage = remote.loadImage(image), localImage = local.loadImage(image);
+  if (remoteImage == 0 || localImage == 0) {
+    std::cerr << "Image loading failed" << std::endl;
+    return false;
+  }
+
+  const std::list<cv::Point> points = {{image.cols / 2, image.rows / 2},
+                                       {image.cols / 4, image.rows / 3}};
+  for (const auto& point : points) {
+    cv::Mat remoteMask, localMask;
+    double remoteIou = 0, localIou = 0;
+    if (!remote.getMask(remoteImage, point, remoteMask, &remoteIou) ||
+        !local.getMask(localImage, point, localMask, &localIou) ||
+        cv::countNonZero(remoteMask != localMask) > 0 || remoteIou != localIou) {
+      std::cerr << "getMask results differ at " << point << std::endl;
+      return false;
+    }
+  }
+
+  Sam::AutoSegmentParameter param(cv::Size(16, 16));
+  int remoteObjects = 0, localObjects = 0;
+  const cv::Mat remoteLabels = remote.autoSegment(remoteImage, param, &remoteObjects);
+  const cv::Mat localLabels = local.autoSegment(localImage, param, &localObjects);
+  if (remoteLabels.empty() || remoteLabels.size() != localLabels.size() ||
+      remoteObjects != localObjects || cv::norm(remoteLabels, localLabels, cv::NORM_INF) > 0) {
+    std::cerr << "autoSegment results differ" << std::endl;
+    return false;
+  }
+  std::cout << "Self check passed (" << remoteObjects << " objects)" << std::endl;
+  return true;
+}
+
+int main(int argc, char** argv) {
+  gflags::ParseCommandLineNonHelpFlags(&argc, &argv, true);
+  if (FLAGS_h) {
+    std::cout << "Example: ./sam_server -pre_model=\"models/sam_preprocess.onnx\" "
+                 "-sam_model=\"models/sam_vit_h_4b8939.onnx\" -socket=\"/tmp/sam_server.sock\""
+              << std::endl;
+    return 0;
+  }
+
+  const int threads =
+      FLAGS_threads > 0 ? FLAGS_threads : int(std::thread::hardware_concurrency());
+  Sam::Parameter param(FLAGS_pre_model, FLAGS_sam_model, threads);
+  // The connections run concurrently, on the same threads
+  param.globalThreadPool = true;
+  if (!parseDeviceName(FLAGS_pre_device, param.providers[0]) ||
+      !parseDeviceName(FLAGS_sam_device, param.providers[1])) {
+    std::cerr << "Unable to parse device name" << std::endl;
+  }
+
+  std::cout << "Loading model..." << std::endl;
+  auto server = std::make_shared<SamServer>(param);
+  if (server->getInputSize().empty()) {
+    std::cout << "Sam initialization failed" << std::endl;
+    return -1;
+  }
+
+  std::signal(SIGINT, [](int) { g_stop = true; });
+  std::signal(SIGTERM, [](int) { g_stop = true; });
+
+  if (!FLAGS_self_check.empty()) {
+    std::thread serving([&] { server->serve(FLAGS_socket, g_stop); });
+    // Wait for the socket
+    for (int i = 0; i < 50 && !SamClient(FLAGS_socket).isConnected(); i++) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    const bool bPassed = selfCheck(server);
+    g_stop = true;
+    serving.join();
+    return bPassed ? 0 : -1;
+  }
+
+  std::cout << "Listening on " << FLAGS_socket << std::endl;
+  return server->serve(FLAGS_socket, g_stop) ? 0 : -1;
+}
@@ -0,0 +1,243 @@
+#include "sam_shared_embeddings.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <functional>
+#include <iostream>
+
+namespace {
+
+constexpr uint32_t kIndexMagic = 0x58444953;    // "SIDX"
+constexpr uint32_t kSegmentMagic = 0x424d4553;  // "SEMB"
+constexpr size_t kHeaderSize = 64;              // keeps the values on a cache line boundary
+
+// Segment /sam_emb_<name>, the generation of the latest segment
+struct Index {
+  uint32_t magic;
+  std::atomic<uint64_t> next, current;
+};
+
+// Head of the segment /sam_emb_<name>.<generation>, followed by the values and intermValues
+struct Header {
+  uint32_t magic;
+  int32_t width, height;
+  uint64_t generation, numValues, numIntermValues;
+};
+static_assert(sizeof(Header) <= kHeaderSize, "Header too large");
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "Index not shareable");
+
+bool validName(const std::string& name) {
+  if (name.empty() || name.find('/') != std::string::npos) {
+    std::cerr << "Invalid shared embedding name " << name << std::endl;
+    return false;
+  }
+  return true;
+}
+
+std::string indexName(const std::string& name) { return "/sam_emb_" + name; }
+std::string segmentName(const std::string& name, uint64_t generation) {
+  return indexName(name) + "." + std::to_string(generation);
+}
+
+// Mapping of the index of name, created by publishers, nullptr if it does not exist
+Index* mapIndex(const std::string& name, bool bCreate) {
+  const auto path = indexName(name);
+  const int fd = shm_open(path.c_str(), bCreate ? O_RDWR | O_CREAT : O_RDWR, 0600);
+  if (fd < 0) {
+    if (bCreate || errno != ENOENT) {
+      std::cerr << "Unable to open " << path << ": " << std::strerror(errno) << std::endl;
+    }
+    return nullptr;
+  }
+  struct stat st {};
+  bool bOk = fstat(fd, &st) == 0;
+  if (bOk && st.st_size < off_t(sizeof(Index))) {
+    // Grows the new index with zeros, a reader may see it before the publisher sets its size
+    bOk = bCreate && ftruncate(fd, sizeof(Index)) == 0;
+  }
+  void* p = bOk ? mmap(nullptr, sizeof(Index), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)
+                : MAP_FAILED;
+  close(fd);
+  if (p == MAP_FAILED) {
+    if (bCreate) std::cerr << "Unable to map " << path << std::endl;
+    return nullptr;
+  }
+  auto* index = static_cast<Index*>(p);
+  if (bCreate && index->magic != kIndexMagic) {
+    index->magic = kIndexMagic;
+  }
+  if (index->magic != kIndexMagic) {
+    munmap(p, sizeof(Index));
+    return nullptr;
+  }
+  return index;
+}
+
+// Publishes a new segment of name, its values and intermValues being written in place by fill
+uint64_t publishSegment(const std::string& name, size_t numValues, size_t numIntermValues,
+                        const cv::Size& imageSize,
+                        const std::function<void(float* values, float* intermValues)>& fill) {
+  if (!validName(name)) {
+    return 0;
+  }
+  if (numValues == 0 || imageSize.empty()) {
+    std::cerr << "Image not loaded" << std::endl;
+    return 0;
+  }
+  Index* index = mapIndex(name, true);
+  if (index == nullptr) {
+    return 0;
+  }
+
+  // The segment is complete before its generation is published
+  const uint64_t generation = index->next.fetch_add(1) + 1;
+  const auto path = segmentName(name, generation);
+  const size_t bytes = kHeaderSize + (numValues + numIntermValues) * sizeof(float);
+  const int fd = shm_open(path.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+  void* p = fd >= 0 && ftruncate(fd, bytes) == 0
+                ? mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)
+                : MAP_FAILED;
+  if (fd >= 0) close(fd);
+  if (p == MAP_FAILED) {
+    std::cerr << "Unable to create " << path << ": " << std::strerror(errno) << std::endl;
+    if (fd >= 0) shm_unlink(path.c_str());
+    munmap(index, sizeof(Index));
+    return 0;
+  }
+  auto* data = static_cast<uint8_t*>(p);
+  Header header{kSegmentMagic, imageSize.width, imageSize.height, generation, numValues,
+                numIntermValues};
+  std::memcpy(data, &header, sizeof(header));
+  auto* values = reinterpret_cast<float*>(data + kHeaderSize);
+  fill(values, values + numValues);
+  munmap(p, bytes);
+
+  // Concurrent publishers of a name only move the generation forward
+  uint64_t previous = index->current.load();
+  while (previous < generation && !index->current.compare_exchange_weak(previous, generation)) {
+  }
+  munmap(index, sizeof(Index));
+  if (previous > generation) {
+    // Published over by a later generation
+    shm_unlink(path.c_str());
+    return previous;
+  }
+  if (previous != 0) {
+    shm_unlink(segmentName(name, previous).c_str());
+  }
+  return generation;
+}
+
+}  // namespace
+
+uint64_t SamSharedEmbeddings::publish(const std::string& name, const std::vector<float>& values,
+                                      const std::vector<float>& intermValues,
+                                      const cv::Size& imageSize) {
+  return publishSegment(name, values.size(), intermValues.size(), imageSize,
+                        [&](float* segmentValues, float* segmentIntermValues) {
+                          std::copy(values.begin(), values.end(), segmentValues);
+                          std::copy(intermValues.begin(), intermValues.end(),
+                                    segmentIntermValues);
+                        });
+}
+
+uint64_t SamSharedEmbeddings::publish(const std::string& name, const Sam& sam) {
+  // Copied once, from the embedding of sam to the segment
+  uint64_t generation = 0;
+  sam.readEmbedding([&](const float* values, size_t numValues, const float* intermValues,
+                        size_t numIntermValues, const cv::Size& imageSize) {
+    generation = publishSegment(name, numValues, numIntermValues, imageSize,
+                                [&](float* segmentValues, float* segmentIntermValues) {
+                                  std::copy(values, values + numValues, segmentValues);
+                                  std::copy(intermValues, intermValues + numIntermValues,
+                                            segmentIntermValues);
+                                });
+    return generation != 0;
+  });
+  return generation;
+}
+
+uint64_t SamSharedEmbeddings::generation(const std::string& name) {
+  if (!validName(name)) {
+    return 0;
+  }
+  Index* index = mapIndex(name, false);
+  if (index == nullptr) {
+    return 0;
+  }
+  const uint64_t current = index->current.load();
+  munmap(index, sizeof(Index));
+  return current;
+}
+
+bool SamSharedEmbeddings::attach(Sam& sam, const std::string& name, uint64_t* generation) {
+  if (!validName(name)) {
+    return false;
+  }
+  Index* index = mapIndex(name, false);
+  if (index == nullptr) {
+    std::cerr << "No embedding published as " << name << std::endl;
+    return false;
+  }
+
+  // The segment of the generation read may be unlinked by a new publication before it is opened
+  int fd = -1;
+  uint64_t current = 0;
+  for (int attempt = 0; attempt < 8 && fd < 0; attempt++) {
+    current = index->current.load();
+    if (current == 0) break;
+    fd = shm_open(segmentName(name, current).c_str(), O_RDONLY, 0);
+  }
+  munmap(index, sizeof(Index));
+  struct stat st {};
+  if (fd < 0 || fstat(fd, &st) != 0 || st.st_size < off_t(kHeaderSize)) {
+    std::cerr << "No embedding published as " << name << std::endl;
+    if (fd >= 0) close(fd);
+    return false;
+  }
+  const size_t bytes = st.st_size;
+  void* p = mmap(nullptr, bytes, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED) {
+    std::cerr << "Unable to map " << segmentName(name, current) << std::endl;
+    return false;
+  }
+  // The mapping lives as long as sam decodes from it
+  std::shared_ptr<const void> owner(
+      p, [bytes](const void* mapping) { munmap(const_cast<void*>(mapping), bytes); });
+
+  Header header;
+  std::memcpy(&header, p, sizeof(header));
+  if (header.magic != kSegmentMagic || header.generation != current ||
+      kHeaderSize + (header.numValues + header.numIntermValues) * sizeof(float) > bytes) {
+    std::cerr << "Invalid shared embedding " << segmentName(name, current) << std::endl;
+    return false;
+  }
+  const auto* values = reinterpret_cast<const float*>(static_cast<const uint8_t*>(p) + kHeaderSize);
+  if (!sam.setEmbedding(values, header.numValues, values + header.numValues,
+                        header.numIntermValues, cv::Size(header.width, header.height), owner)) {
+    return false;
+  }
+  if (generation != nullptr) {
+    *generation = current;
+  }
+  return true;
+}
+
+bool SamSharedEmbeddings::remove(const std::string& name) {
+  if (!validName(name)) {
+    return false;
+  }
+  const uint64_t current = generation(name);
+  if (current != 0) {
+    shm_unlink(segmentName(name, current).c_str());
+  }
+  return shm_unlink(indexName(name).c_str()) == 0;
+}
@@ -0,0 +1,29 @@
+#ifndef SAMCPP__SAM_SHARED_EMBEDDINGS_H_
+#define SAMCPP__SAM_SHARED_EMBEDDINGS_H_
+
+#include <cstdint>
+
+#include "sam.h"
+
+// Embeddings published by an encoder process in named POSIX shared memory, decoded in place by
+// other processes (e.g. decoder-only instances, without models[0]). Each publication of a name
+// is a new read-only segment with a higher generation, the previous one being unlinked: the
+// processes attached to it keep their mapping until they attach to another one. The processes
+// must run as the same user (Unix only).
+class SamSharedEmbeddings {
+ public:
+  // Generation of the published embedding, 0 on failure. name must not contain '/'.
+  static uint64_t publish(const std::string& name, const std::vector<float>& values,
+                          const std::vector<float>& intermValues, const cv::Size& imageSize);
+  // Publishes the embedding of the image loaded by sam, copied straight into the segment
+  static uint64_t publish(const std::string& name, const Sam& sam);
+  // Latest generation of name, 0 if nothing is published
+  static uint64_t generation(const std::string& name);
+  // Sets the latest embedding of name on sam without copying it, generation being set to its
+  // generation (attach again when generation(name) differs to follow the encoder)
+  static bool attach(Sam& sam, const std::string& name, uint64_t* generation = nullptr);
+  // Unlinks name, the attached processes keep their mapping
+  static bool remove(const std::string& name);
+};
+
+#endif  // SAMCPP__SAM_SHARED_EMBEDDINGS_H_
@@ -5,14 +5,32 @@
 #include <opencv2/core.hpp>
 #include <list>
 
+class Sam;
+
+#if _MSC_VER
 class __declspec(dllexport) SamWrapper {
+#else
+class SamWrapper {
+#endif
+  Sam* m_sam{nullptr};  // owned by each instance, several models can be hosted in one process
+
  public:
   SamWrapper(const std::string& preModelPath, const std::string& samModelPath, int threadsNumber);
   ~SamWrapper();
+  SamWrapper(const SamWrapper&) = delete;
+  SamWrapper& operator=(const SamWrapper&) = delete;
+
   cv::Size getInputSize() const;
   bool loadImage(const cv::Mat& image);
   cv::Mat getMask(const std::list<cv::Point>& points, const std::list<cv::Point>& negativePoints,
                   const cv::Rect& roi, double* iou = nullptr) const;
+  // Writes the mask into a caller buffer, without allocation if mask is already a CV_8UC1 image
+  // of the input size (cleared if decoding fails)
+  bool getMask(const std::list<cv::Point>& points, const std::list<cv::Point>& negativePoints,
+               const cv::Rect& roi, cv::Mat& mask, double* iou = nullptr) const;
+  // Same with a raw buffer of getInputSize().height rows of step bytes
+  bool getMask(const std::list<cv::Point>& points, const std::list<cv::Point>& negativePoints,
+               const cv::Rect& roi, unsigned char* mask, size_t step, double* iou = nullptr) const;
 };
 
   // 使用 typedef 定义指针类型
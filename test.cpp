@@ -1,5 +1,10 @@
 #include <atomic>
+#include <condition_variable>
+#include <iomanip>
+#include <mutex>
 #include <opencv2/opencv.hpp>
+#include <optional>
+#include <sstream>
 #include <thread>
 
 #define STRIP_FLAG_HELP 1
@@ -15,6 +20,88 @@ DEFINE_string(pre_device, "cpu", "cpu or cuda:0(1,2,3...)");
 DEFINE_string(sam_device, "cpu", "cpu or cuda:0(1,2,3...)");
 DEFINE_bool(h, false, "Show help");
 
+using Clock = std::chrono::steady_clock;
+static double elapsedMs(const Clock::time_point& start) {
+  return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+
+// Latest-value mailbox between two stages of the demo: put replaces the value not taken yet
+template <typename T>
+class Mailbox {
+ public:
+  void put(T value) {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      if (m_value) {
+        m_dropped++;
+      }
+      m_value = std::move(value);
+    }
+    m_condition.notify_one();
+  }
+  // Waits for a value, false once closed
+  bool take(T& value) {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_condition.wait(lock, [this] { return m_value || m_bClosed; });
+    return !m_bClosed && pop(value);
+  }
+  bool tryTake(T& value) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return pop(value);
+  }
+  void clear() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_value.reset();
+  }
+  void close() {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_bClosed = true;
+    }
+    m_condition.notify_all();
+  }
+  // Values replaced before being taken
+  int dropped() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_dropped;
+  }
+
+ private:
+  bool pop(T& value) {
+    if (!m_value) {
+      return false;
+    }
+    value = std::move(*m_value);
+    m_value.reset();
+    return true;
+  }
+
+  mutable std::mutex m_mutex;
+  std::condition_variable m_condition;
+  std::optional<T> m_value;
+  bool m_bClosed{false};
+  int m_dropped{0};
+};
+
+struct Prompt {
+  std::list<cv::Point> points, negativePoints;
+  cv::Rect roi;
+  int sequence{0};
+  Clock::time_point time;  // of the click
+};
+
+struct Result {
+  Prompt prompt;
+  cv::Mat mask;
+  double decoderMs{0};
+};
+
+struct Frame {
+  Prompt prompt;
+  cv::Mat image;
+  double decoderMs{0}, renderMs{0};
+};
+
 bool parseDeviceName(const std::string& name, Sam::Parameter::Provider& provider) {
   if (name == "cpu") {
     provider.deviceType = 0;
@@ -83,7 +170,66 @@ int main(int argc, char** argv) {
   std::list<cv::Point3i> clickedPoints;
   cv::Point3i newClickedPoint(-1, 0, 0);
   cv::Rect roi;
-  cv::Mat outImage = image.clone();
+
+  // The UI loop only posts prompts and shows frames: the decoder and the renderer run on their own
+  // threads, connected by latest-value mailboxes, so clicks arriving during a decoder run replace
+  // each other and only the latest one is decoded
+  Mailbox<Prompt> prompts;
+  Mailbox<Result> results;
+  Mailbox<Frame> frames;
+  Mailbox<cv::Mat> freeMasks, freeFrames;  // buffers given back to the decoder and the renderer
+  std::atomic<int> clearedSequence{0};      // prompts up to it are not shown anymore
+  int sequence = 0;
+
+  std::thread decoder([&] {
+    Prompt prompt;
+    while (prompts.take(prompt)) {
+      Result result;
+      if (!freeMasks.tryTake(result.mask)) {
+        result.mask.create(inputSize, CV_8UC1);
+      }
+      const auto start = Clock::now();
+      //sam.getMask(prompt.points, prompt.negativePoints, prompt.roi, result.mask);
+      wrapperPtr->getMask(prompt.points, prompt.negativePoints, prompt.roi, result.mask);
+      result.decoderMs = elapsedMs(start);
+      result.prompt = std::move(prompt);
+      results.put(std::move(result));
+    }
+  });
+
+  std::thread renderer([&] {
+    Result result;
+    while (results.take(result)) {
+      if (result.prompt.sequence <= clearedSequence) {
+        continue;
+      }
+      const auto start = Clock::now();
+      Frame frame;
+      if (!freeFrames.tryTake(frame.image)) {
+        frame.image.create(image.size(), CV_8UC3);
+      }
+      // apply mask to image
+      image.convertTo(frame.image, -1, 0.2);
+      image.copyTo(frame.image, result.mask);
+
+      // 
+      std::vector<std::vector<cv::Point>> contours;
+      cv::findContours(result.mask, contours, cv::RETR_EXTERNAL, cv::CHAIN_APPROX_SIMPLE);
+      cv::drawContours(frame.image, contours, -1, cv::Scalar(255, 255, 255), 2, cv::LINE_8);
+      for (auto& p : result.prompt.points) {
+        cv::circle(frame.image, p, 3, {0, 255, 0}, -1);
+      }
+      for (auto& p : result.prompt.negativePoints) {
+        cv::circle(frame.image, p, 3, {0, 0, 255}, -1);
+      }
+
+      frame.prompt = std::move(result.prompt);
+      frame.decoderMs = result.decoderMs;
+      frame.renderMs = elapsedMs(start);
+      freeMasks.put(std::move(result.mask));
+      frames.put(std::move(frame));
+    }
+  });
 
   auto g_windowName = "Segment Anything CPP Demo";
   cv::namedWindow(g_windowName, 0);
@@ -112,19 +258,14 @@ int main(int argc, char** argv) {
       },
       &newClickedPoint);
 
-#define SHOW_TIME                                                     \
-  std::cout << "Time elapsed: "                                       \
-            << std::chrono::duration_cast<std::chrono::milliseconds>( \
-                   std::chrono::system_clock::now() - timeNow)        \
-                   .count()                                           \
-            << " ms" << std::endl;
-
+  Frame shown;  // latest frame, drawn again with the box and the latency HUD on every iteration
+  image.copyTo(shown.image);
+  cv::Mat outImage;
+  double clickToFrameMs = 0;
   bool bRunning = true;
   while (bRunning) {
-    const auto timeNow = std::chrono::system_clock::now();
-
     if (newClickedPoint.x > 0) {
-      std::list<cv::Point> points, nagativePoints;
+      Prompt prompt;
       if (newClickedPoint.z == 5) {
         roi = {};
       } else if (newClickedPoint.z == 4) {
@@ -135,10 +276,8 @@ int main(int argc, char** argv) {
           // construct a rectangle from two points
           roi = cv::Rect(cv::Point(std::min(tl.x, np.x), std::min(tl.y, np.y)),
                          cv::Point(std::max(tl.x, np.x), std::max(tl.y, np.y)));
-          std::cout << "Box: " << roi << std::endl;
         }
       } else {
-        //std::cout << "----" << newClickedPoint.z << "----" << newClickedPoint.z % 2 << std::endl;
         if (newClickedPoint.z % 2 == 0) {
           clickedPoints = {newClickedPoint};
         } else {
@@ -148,109 +287,20 @@ int main(int argc, char** argv) {
 
       for (auto& p : clickedPoints) {
         if (p.z >= 2) {
-          points.push_back({p.x, p.y});
+          prompt.points.push_back({p.x, p.y});
         } else {
-          nagativePoints.push_back({p.x, p.y});
+          prompt.negativePoints.push_back({p.x, p.y});
         }
       }
 
       newClickedPoint.x = -1;
-      if (points.empty() && nagativePoints.empty() && roi.empty()) {
-        continue;
+      if (!prompt.points.empty() || !prompt.negativePoints.empty() || !roi.empty()) {
+        prompt.roi = roi;
+        prompt.sequence = ++sequence;
+        prompt.time = Clock::now();
+        prompts.put(std::move(prompt));
       }
-
-      //cv::Mat mask = sam.getMask(points, nagativePoints, roi);
-      cv::Mat mask = wrapperPtr->getMask(points, nagativePoints, roi);
-
-      
-      SHOW_TIME
-
-      // apply mask to image
-      outImage = cv::Mat::zeros(image.size(), CV_8UC3);
-      for (int i = 0; i < image.rows; i++) {
-        for (int j = 0; j < image.cols; j++) {
-          auto bFront = mask.at<uchar>(i, j) > 0;
-          float factor = bFront ? 1.0 : 0.2;
-          outImage.at<cv::Vec3b>(i, j) = image.at<cv::Vec3b>(i, j) * factor;
-        }
-      }
-
-      //for (auto& p : points) {
-      //  cv::circle(outImage, p, 2, {0, 255, 255}, -1);
-      //}
-      //for (auto& p : nagativePoints) {
-      //  cv::circle(outImage, p, 2, {255, 0, 0}, -1);
-      //}
-
-
-      //// ȡָ
-      //std::vector<cv::Point> segmentationPoints;
-      //for (int i = 0; i < mask.rows; i++) {
-      //  for (int j = 0; j < mask.cols; j++) {
-      //    if (mask.at<uchar>(i, j) > 0) {
-      //      segmentationPoints.push_back(cv::Point(j, i));
-      //    }
-      //  }
-      //}
-      //// ȡ outImage 
-      //for (auto& p : segmentationPoints) {
-      //  cv::circle(outImage, p, 2, {0, 255, 0}, -1);  // ʹɫǷָ
-      //}
-
-
-
-
-      // 
-      std::vector<std::vector<cv::Point>> contours;
-      cv::Mat contoursImage = cv::Mat::zeros(mask.size(), CV_8UC3);
-      cv::findContours(mask, contours, cv::RETR_EXTERNAL, cv::CHAIN_APPROX_SIMPLE);
-      // contours д洢еÿһһϵе
-      for (size_t i = 0; i < contours.size(); ++i) {
-        // еÿ
-        //std::cout << "--i---" << i << std::endl;
-        cv::drawContours(contoursImage, contours, static_cast<int>(i), cv::Scalar(255, 255, 255), 2, cv::LINE_8);
-        for (size_t j = 0; j < contours[i].size(); ++j) {
-          // ȡеĵ
-          cv::Point point = contours[i][j];
-          //std::cout << "-----" << point.x << " " << point.y;
-        }
-      }
-      //cv::imshow("Contours", contoursImage);
-
-
-
-      //// ʹCannyԵ㷨Ե
-      //cv::Mat edges;
-      //cv::Canny(mask, edges, 20, 100, 7, true);  // ֵԻѱԵЧ
-      ////// ӦScharrӽбԵ
-      ////cv::Mat scharrX, scharrY;
-      ////cv::Scharr(mask, scharrX, CV_32F, 1, 0);   // ˮƽıԵ
-      ////cv::Scharr(mask, scharrY, CV_32F, 0, 1);  // 㴹ֱıԵ
-      ////cv::Mat edgeMagnitude, edgeDirection;
-      ////cv::cartToPolar(scharrX, scharrY, edgeMagnitude, edgeDirection);
-      ////cv::imshow("Edge Magnitude", edgeMagnitude);
-      ////cv::imwrite("segmentation_edges_scharr.png", edgeMagnitude);
-
-      //// ƱԵ
-      ////cv::Mat result = cv::Mat::zeros(mask.size(), CV_8UC3);
-      ////result.setTo(cv::Scalar(255, 255, 255));     // ɫ
-      ////result.setTo(cv::Scalar(0, 0, 255), edges);  // ɫԵ
-      ////cv::imwrite("segmentation_edges.png", result);
-      //std::vector<cv::Point> segmentationPoints;
-      //for (int i = 0; i < edges.rows; i++) {
-      //  for (int j = 0; j < edges.cols; j++) {
-      //    if (edges.at<uchar>(i, j) > 0) {
-      //      segmentationPoints.push_back(cv::Point(j, i));
-      //    }
-      //  }
-      //}
-      //for (auto& p : segmentationPoints) {
-      //  cv::circle(outImage, p, 2, {0, 255, 0}, -1);  // ʹɫǷָ
-      //} 
-
-
-
-    } 
+    }
     //else if (newClickedPoint.x == -2) {
     //  newClickedPoint.x = -1;
     //  int step = 40;
@@ -261,7 +311,6 @@ int main(int argc, char** argv) {
 
     //  auto mask = sam.autoSegment(
     //      sampleSize, [](double v) { std::cout << "\rProgress: " << int(v * 100) << "%\t"; });
-    //  SHOW_TIME
 
     //  const double overlayFactor = 0.5;
     //  const int maxMaskValue = 255 * (1 - overlayFactor);
@@ -294,12 +343,28 @@ int main(int argc, char** argv) {
     //  }
     //}
 
+    Frame frame;
+    if (frames.tryTake(frame) && frame.prompt.sequence > clearedSequence) {
+      clickToFrameMs = elapsedMs(frame.prompt.time);
+      freeFrames.put(std::move(shown.image));
+      shown = std::move(frame);
+    }
+
+    shown.image.copyTo(outImage);
     if (!roi.empty()) {
       cv::rectangle(outImage, roi, {255, 255, 255}, 2);
     }
+    if (shown.prompt.sequence > 0) {
+      std::ostringstream hud;
+      hud << std::fixed << std::setprecision(1) << "decoder " << shown.decoderMs
+          << " ms | render " << shown.renderMs << " ms | click to frame " << clickToFrameMs
+          << " ms | stale clicks dropped " << prompts.dropped();
+      cv::putText(outImage, hud.str(), {10, 24}, cv::FONT_HERSHEY_SIMPLEX, 0.6, {0, 0, 0}, 3);
+      cv::putText(outImage, hud.str(), {10, 24}, cv::FONT_HERSHEY_SIMPLEX, 0.6, {0, 255, 255}, 1);
+    }
 
     cv::imshow(g_windowName, outImage);
-    int key = cv::waitKeyEx(100);
+    int key = cv::waitKeyEx(5);
     switch (key) {
       case 27:
       case 'Q':
@@ -311,17 +376,27 @@ int main(int argc, char** argv) {
         clickedPoints.clear();
         newClickedPoint.x = -1;
         roi = {};
-        outImage = image.clone();
+        clearedSequence = sequence;
+        prompts.clear();
+        image.copyTo(shown.image);
+        shown.prompt = Prompt();
       } break;
       case 'A':
       case 'a': {
         clickedPoints.clear();
         newClickedPoint.x = -2;
-        outImage = image.clone();
+        clearedSequence = sequence;
+        prompts.clear();
+        image.copyTo(shown.image);
+        shown.prompt = Prompt();
       }
     }
   }
 
+  prompts.close();
+  results.close();
+  decoder.join();
+  renderer.join();
   cv::destroyWindow(g_windowName);
 
   return 0;